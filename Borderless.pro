@@ -22,7 +22,7 @@ isEmpty(_BOOST_ROOT) {
     INCLUDEPATH += $$_BOOST_ROOT
 }
 
-QT += core gui network widgets
+QT += core gui network widgets svg
 
 TARGET = Borderless
 TEMPLATE = app
@@ -30,6 +30,15 @@ QMAKE_CXXFLAGS += -std=c++11
 INCLUDEPATH += $$PWD/src
 
 SOURCES +=  src/DirectoryListing.cpp          \
+            src/AnimationFrames.cpp           \
+            src/AnimationStream.cpp           \
+            src/ColorAnalysis.cpp             \
+            src/CommandConnection.cpp         \
+            src/CommandLog.cpp                \
+            src/CommandProtocol.cpp           \
+            src/CommandRing.cpp               \
+            src/CommandStats.cpp              \
+            src/ImageFormat.cpp               \
             src/ImageViewerApplication.cpp    \
             src/ImageViewport.cpp             \
             src/LoadedImage.cpp               \
@@ -48,8 +57,18 @@ SOURCES +=  src/DirectoryListing.cpp          \
             src/ZoomModeDropDown.cpp
 
 HEADERS += src/DirectoryListing.h          \
+           src/AnimationFrames.h           \
+           src/AnimationStream.h           \
+           src/ColorAnalysis.h             \
+           src/CommandConnection.h         \
+           src/CommandLog.h                \
+           src/CommandProtocol.h           \
+           src/CommandRing.h               \
+           src/CommandStats.h              \
            src/Enums.h                     \
            src/GenericException.h          \
+           src/HandleTable.h               \
+           src/ImageFormat.h               \
            src/ImageViewerApplication.h    \
            src/ImageViewport.h             \
            src/LoadedImage.h               \
@@ -0,0 +1,46 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <algorithm>
+#include <vector>
+
+//Runs f repeatedly and prints the best and median time per iteration.
+inline void run_benchmark(const std::string &name, int iterations, const std::function<void()> &f){
+	typedef std::chrono::high_resolution_clock T;
+	std::vector<double> times;
+	times.reserve(iterations);
+	//Warm up.
+	f();
+	for (int i = 0; i < iterations; i++){
+		auto t0 = T::now();
+		f();
+		auto t1 = T::now();
+		times.push_back(std::chrono::duration<double, std::milli>(t1 - t0).count());
+	}
+	std::sort(times.begin(), times.end());
+	std::cout
+		<< std::left << std::setw(40) << name << std::right
+		<< " best " << std::setw(10) << std::fixed << std::setprecision(3) << times.front() << " ms"
+		<< "   median " << std::setw(10) << times[times.size() / 2] << " ms\n";
+}
+
+//Prevents the compiler from discarding a computed value.
+template <typename T>
+void do_not_optimize(const T &x){
+	static volatile const void *sink;
+	sink = &x;
+}
+
+#endif
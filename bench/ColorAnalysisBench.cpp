@@ -0,0 +1,67 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "Bench.h"
+#include "ColorAnalysis.h"
+#include <random>
+
+namespace{
+
+//The implementation LoadedImage used to run on every load, kept here as a
+//baseline.
+QColor scalar_average_color(QImage src){
+	if (src.depth() < 32)
+		src = src.convertToFormat(QImage::Format_ARGB32);
+	quint64 avg[3] = {0};
+	unsigned pixel_count = 0;
+	for (auto y = 0; y < src.height(); y++){
+		const uchar *p = src.constScanLine(y);
+		for (auto x = 0; x < src.width(); x++){
+			avg[0] += quint64(p[2]) * quint64(p[3]) / 255;
+			avg[1] += quint64(p[1]) * quint64(p[3]) / 255;
+			avg[2] += quint64(p[0]) * quint64(p[3]) / 255;
+			p += 4;
+			pixel_count++;
+		}
+	}
+	for (int a = 0; a < 3; a++)
+		avg[a] /= pixel_count;
+	return QColor(avg[0], avg[1], avg[2]);
+}
+
+QImage make_noise(int w, int h){
+	QImage ret(w, h, QImage::Format_ARGB32);
+	std::mt19937 rng(42);
+	for (int y = 0; y < h; y++){
+		auto p = (quint32 *)ret.scanLine(y);
+		for (int x = 0; x < w; x++)
+			p[x] = rng();
+	}
+	return ret;
+}
+
+}
+
+void color_analysis_bench(){
+	std::cout << "Background color analysis\n";
+	const int sizes[][2] = {
+		{ 256, 256 },
+		{ 1920, 1080 },
+		{ 8000, 6000 },
+	};
+	for (auto &size : sizes){
+		auto img = make_noise(size[0], size[1]);
+		auto label = std::to_string(size[0]) + "x" + std::to_string(size[1]);
+		int iterations = size[0] * size[1] > 10000000 ? 5 : 50;
+		auto a = scalar_average_color(img);
+		auto b = get_average_color(img);
+		std::cout << "  " << label << " scalar=" << a.name().toStdString() << " simd=" << b.name().toStdString() << "\n";
+		run_benchmark("  scalar " + label, iterations, [&](){ do_not_optimize(scalar_average_color(img)); });
+		run_benchmark("  parallel simd " + label, iterations, [&](){ do_not_optimize(get_average_color(img)); });
+		run_benchmark("  sampled " + label, iterations, [&](){ do_not_optimize(get_average_color(img, default_color_analysis_max_pixels / 16)); });
+	}
+}
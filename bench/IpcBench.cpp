@@ -0,0 +1,174 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "Bench.h"
+#include "CommandConnection.h"
+#include "CommandClient.h"
+#include <QtNetwork/QLocalServer>
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QTimer>
+#include <map>
+#include <memory>
+#include <thread>
+
+namespace{
+
+//Stands in for the application: accepts connections and runs a trivial
+//command, so that only the transport is measured.
+class BenchServer{
+	QLocalServer server;
+	std::map<QLocalSocket *, std::unique_ptr<CommandConnection>> connections;
+	int commands = 0;
+public:
+	BenchServer(const QString &name){
+		QLocalServer::removeServer(name);
+		this->server.listen(name);
+		QObject::connect(&this->server, &QLocalServer::newConnection, [this](){
+			while (auto socket = this->server.nextPendingConnection()){
+				auto dispatcher = [this](const QStringList &args){
+					this->commands += args.size();
+					return CommandResult();
+				};
+				auto connection = std::make_unique<CommandConnection>(socket, dispatcher, 0);
+				connection->set_binary_dispatcher([this](const BinaryCommand &command, const std::string &){
+					this->commands += command.operand_count;
+					return CommandResult();
+				});
+				connection->on_closed = [this, socket](){
+					QTimer::singleShot(0, &this->server, [this, socket](){
+						this->connections.erase(socket);
+						socket->deleteLater();
+					});
+				};
+				auto p = connection.get();
+				this->connections[socket] = std::move(connection);
+				p->start();
+			}
+		});
+	}
+};
+
+const QStringList test_command = { "move", "sprite", "+1", "-1" };
+
+void run_client_benchmark(const std::string &name, int commands, const std::function<bool()> &f){
+	typedef std::chrono::high_resolution_clock T;
+	QEventLoop loop;
+	bool success = false;
+	double seconds = 0;
+	std::thread thread([&](){
+		auto t0 = T::now();
+		success = f();
+		seconds = std::chrono::duration<double>(T::now() - t0).count();
+		QMetaObject::invokeMethod(&loop, "quit", Qt::QueuedConnection);
+	});
+	loop.exec();
+	thread.join();
+	std::cout << std::left << std::setw(40) << name << std::right;
+	if (!success){
+		std::cout << " failed\n";
+		return;
+	}
+	std::cout << std::setw(12) << std::fixed << std::setprecision(0) << commands / seconds << " commands/s\n";
+}
+
+}
+
+void ipc_bench(){
+	const QString name = "BorderlessIpcBench";
+	BenchServer server(name);
+
+	const int short_lived = 2000;
+	run_client_benchmark("connection per command", short_lived, [&](){
+		for (int i = 0; i < short_lived; i++){
+			CommandClient client;
+			CommandResult result;
+			if (!client.open(name) || !client.execute(result, test_command))
+				return false;
+		}
+		return true;
+	});
+
+	const int lock_step = 50000;
+	run_client_benchmark("persistent, one at a time", lock_step, [&](){
+		CommandClient client;
+		if (!client.open(name))
+			return false;
+		CommandResult result;
+		for (int i = 0; i < lock_step; i++)
+			if (!client.execute(result, test_command))
+				return false;
+		return true;
+	});
+
+	const int pipelined = 500000;
+	run_client_benchmark("persistent, pipelined", pipelined, [&](){
+		CommandClient client;
+		if (!client.open(name))
+			return false;
+		//Keep a bounded number of commands in flight.
+		const quint32 window = 256;
+		CommandReply reply;
+		for (int i = 0; i < pipelined; i++){
+			client.send(test_command);
+			if (client.get_outstanding() >= window && !client.receive(reply))
+				return false;
+		}
+		if (!client.flush())
+			return false;
+		while (client.get_outstanding())
+			if (!client.receive(reply))
+				return false;
+		return true;
+	});
+
+	run_client_benchmark("persistent, pipelined, binary", pipelined, [&](){
+		CommandClient client;
+		if (!client.open(name))
+			return false;
+		const quint32 window = 256;
+		const quint32 target = 1;
+		CommandReply reply;
+		client.bind(target, "sprite");
+		for (int i = 0; i < pipelined; i++){
+			BinaryCommandWriter command(Opcode::Move, target);
+			command.add_int(1, true).add_int(-1, true);
+			client.send(command);
+			if (client.get_outstanding() >= window && !client.receive(reply))
+				return false;
+		}
+		if (!client.flush())
+			return false;
+		while (client.get_outstanding())
+			if (!client.receive(reply))
+				return false;
+		return true;
+	});
+
+	//Only measures how fast the producer can hand commands over; the server
+	//drains the ring on its own schedule. Full rings are retried, so the
+	//drop counter shows how often the producer got ahead.
+	quint64 dropped = 0;
+	run_client_benchmark("shared memory ring", pipelined, [&](){
+		CommandClient client;
+		if (!client.open(name))
+			return false;
+		CommandReply reply;
+		client.bind(1, "sprite");
+		if (!client.flush() || !client.receive(reply) || !client.open_ring(4096))
+			return false;
+		for (int i = 0; i < pipelined; i++){
+			RingCommand command(Opcode::Move, 1);
+			command.add_int(1, true).add_int(-1, true);
+			while (!client.push(command))
+				std::this_thread::yield();
+		}
+		dropped = client.get_ring()->get_dropped();
+		return true;
+	});
+	std::cout << "    ring full " << dropped << " times\n";
+}
@@ -0,0 +1,87 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "Bench.h"
+#include "CommandProtocol.h"
+
+namespace{
+
+const int commands_per_iteration = 100000;
+
+//The string handlers parse their operands with expect_integer() and
+//friends, which live with the script interpreter. QString::toInt() is used
+//here instead, which is if anything cheaper.
+void string_round_trip(){
+	FrameReader reader;
+	qint64 sum = 0;
+	for (int i = 0; i < commands_per_iteration; i++){
+		QStringList command;
+		command << "move" << "sprite" << QString::number(i) << QString::number(-i);
+		reader.append(make_command_frame(command));
+		FrameType type;
+		QByteArray body;
+		while (reader.next(type, body)){
+			auto args = parse_command_body(body);
+			sum += args[2].toInt() + args[3].toInt();
+		}
+	}
+	do_not_optimize(sum);
+}
+
+void binary_round_trip(){
+	FrameReader reader;
+	qint64 sum = 0;
+	for (int i = 0; i < commands_per_iteration; i++){
+		BinaryCommandWriter writer(Opcode::Move, 1);
+		writer.add_int(i).add_int(-i);
+		reader.append(writer.get_frame());
+		FrameType type;
+		QByteArray body;
+		while (reader.next(type, body)){
+			BinaryCommand command;
+			if (parse_binary_command(command, body.constData(), body.size()))
+				sum += command.operands[0].to_int() + command.operands[1].to_int();
+		}
+	}
+	do_not_optimize(sum);
+}
+
+void binary_decode_only(){
+	BinaryCommandWriter writer(Opcode::Move, 1);
+	writer.add_int(10).add_int(-10);
+	auto frame = writer.get_frame();
+	auto body = frame.constData() + command_frame_header_size;
+	auto size = frame.size() - command_frame_header_size;
+	qint64 sum = 0;
+	for (int i = 0; i < commands_per_iteration; i++){
+		BinaryCommand command;
+		if (parse_binary_command(command, body, size))
+			sum += command.operands[0].to_int();
+	}
+	do_not_optimize(sum);
+}
+
+void string_decode_only(){
+	QStringList list;
+	list << "move" << "sprite" << "10" << "-10";
+	auto frame = make_command_frame(list);
+	auto body = QByteArray::fromRawData(frame.constData() + command_frame_header_size, frame.size() - command_frame_header_size);
+	qint64 sum = 0;
+	for (int i = 0; i < commands_per_iteration; i++)
+		sum += parse_command_body(body)[2].toInt();
+	do_not_optimize(sum);
+}
+
+}
+
+void protocol_bench(){
+	std::cout << "Times are per " << commands_per_iteration << " move commands.\n";
+	run_benchmark("string protocol, encode + decode", 20, string_round_trip);
+	run_benchmark("binary protocol, encode + decode", 20, binary_round_trip);
+	run_benchmark("string protocol, decode", 20, string_decode_only);
+	run_benchmark("binary protocol, decode", 20, binary_decode_only);
+}
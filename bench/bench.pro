@@ -0,0 +1,35 @@
+#-------------------------------------------------
+#
+# Microbenchmarks for hot paths in Borderless.
+# Build with qmake && make, then run ./bench.
+#
+#-------------------------------------------------
+
+QT += core gui concurrent network
+QT -= widgets
+
+TARGET = bench
+TEMPLATE = app
+CONFIG += console release
+CONFIG -= app_bundle
+QMAKE_CXXFLAGS += -std=c++14
+INCLUDEPATH += $$PWD/../src
+
+SOURCES +=  ColorAnalysisBench.cpp        \
+            IpcBench.cpp                  \
+            ProtocolBench.cpp             \
+            main.cpp                      \
+            ../src/ColorAnalysis.cpp      \
+            ../src/CommandClient.cpp      \
+            ../src/CommandConnection.cpp  \
+            ../src/CommandProtocol.cpp    \
+            ../src/CommandRing.cpp        \
+            ../src/CommandStats.cpp
+
+HEADERS +=  Bench.h                       \
+            ../src/ColorAnalysis.h        \
+            ../src/CommandClient.h        \
+            ../src/CommandConnection.h    \
+            ../src/CommandProtocol.h      \
+            ../src/CommandRing.h          \
+            ../src/CommandStats.h
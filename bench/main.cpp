@@ -0,0 +1,20 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include <QGuiApplication>
+
+void color_analysis_bench();
+void ipc_bench();
+void protocol_bench();
+
+int main(int argc, char **argv){
+	QGuiApplication app(argc, argv);
+	color_analysis_bench();
+	protocol_bench();
+	ipc_bench();
+	return 0;
+}
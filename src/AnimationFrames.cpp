@@ -0,0 +1,105 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "AnimationFrames.h"
+#include <QImageReader>
+#include <QMutexLocker>
+#include <QtConcurrent/QtConcurrentRun>
+#include <algorithm>
+
+std::shared_ptr<AnimationFrames> AnimationFrames::create(const QString &path, const QByteArray &format){
+	QImageReader reader(path, format);
+	auto size = reader.size();
+	if (!size.isValid())
+		return {};
+	std::shared_ptr<AnimationFrames> ret(new AnimationFrames(size));
+	std::weak_ptr<AnimationFrames> weak = ret;
+	QtConcurrent::run([weak, path, format](){ decode(weak, path, format); });
+	return ret;
+}
+
+void AnimationFrames::decode(std::weak_ptr<AnimationFrames> weak, QString path, QByteArray format){
+	QImageReader reader(path, format);
+	qint64 bytes = 0;
+	int time = 0;
+	while (reader.canRead()){
+		auto image = reader.read();
+		if (image.isNull())
+			break;
+		image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+		auto delay = reader.nextImageDelay();
+		if (delay <= 0)
+			delay = 100;
+		time += delay;
+		bytes += image.byteCount();
+
+		//Stop as soon as nobody is interested anymore.
+		auto self = weak.lock();
+		if (!self)
+			return;
+		QMutexLocker lock(&self->mutex);
+		if (bytes > animation_cache_memory_cap){
+			self->frames.clear();
+			self->frames.shrink_to_fit();
+			self->state = State::TooLarge;
+			return;
+		}
+		self->frames.push_back({ image, QPixmap(), time });
+	}
+	auto self = weak.lock();
+	if (!self)
+		return;
+	QMutexLocker lock(&self->mutex);
+	self->loop_count = reader.loopCount();
+	self->state = self->frames.size() ? State::Complete : State::Failed;
+}
+
+AnimationFrames::State AnimationFrames::get_state() const{
+	QMutexLocker lock(&this->mutex);
+	return this->state;
+}
+
+size_t AnimationFrames::find_frame(qint64 elapsed_ms) const{
+	QMutexLocker lock(&this->mutex);
+	if (!this->frames.size())
+		return 0;
+	if (this->state == State::Complete){
+		qint64 duration = this->frames.back().end_time;
+		//A negative loop count means the animation loops forever.
+		if (this->loop_count >= 0 && elapsed_ms >= duration * (this->loop_count + 1))
+			return this->frames.size() - 1;
+		elapsed_ms %= duration;
+	}else if (elapsed_ms >= this->frames.back().end_time){
+		//Still decoding. Hold the last frame until the next one arrives.
+		return this->frames.size() - 1;
+	}
+	auto it = std::upper_bound(this->frames.begin(), this->frames.end(), elapsed_ms, [](qint64 t, const Frame &f){ return t < f.end_time; });
+	return std::min<size_t>(it - this->frames.begin(), this->frames.size() - 1);
+}
+
+QPixmap AnimationFrames::get_pixmap(size_t frame){
+	QMutexLocker lock(&this->mutex);
+	if (frame >= this->frames.size())
+		return {};
+	auto &f = this->frames[frame];
+	if (f.pixmap.isNull()){
+		f.pixmap = QPixmap::fromImage(f.image);
+		//The pixmap holds its own copy. Don't keep both around.
+		f.image = QImage();
+	}
+	return f.pixmap;
+}
+
+QImage AnimationFrames::get_image(size_t frame) const{
+	QMutexLocker lock(&this->mutex);
+	if (frame >= this->frames.size())
+		return {};
+	auto &f = this->frames[frame];
+	if (!f.image.isNull())
+		return f.image;
+	return f.pixmap.toImage();
+}
@@ -0,0 +1,73 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef ANIMATIONFRAMES_H
+#define ANIMATIONFRAMES_H
+
+#include <QString>
+#include <QByteArray>
+#include <QImage>
+#include <QPixmap>
+#include <QMutex>
+#include <memory>
+#include <vector>
+
+//Animations whose decoded frames would take more than this many bytes are
+//not cached.
+static const qint64 animation_cache_memory_cap = (qint64)256 << 20;
+
+//Holds every frame of an animation, decoded once on a worker thread and
+//shared by all the viewports that display the same file. Frames become
+//available progressively while decoding is still in progress.
+class AnimationFrames{
+public:
+	enum class State{
+		Decoding,
+		Complete,
+		Failed,
+		//The animation exceeded animation_cache_memory_cap. No frames are
+		//kept and callers should fall back to streaming the file.
+		TooLarge,
+	};
+
+private:
+	struct Frame{
+		QImage image;
+		QPixmap pixmap;
+		//Time at which this frame stops being displayed, in milliseconds
+		//since the start of the loop.
+		int end_time;
+	};
+
+	mutable QMutex mutex;
+	std::vector<Frame> frames;
+	State state = State::Decoding;
+	QSize size;
+	int loop_count = -1;
+
+	static void decode(std::weak_ptr<AnimationFrames>, QString path, QByteArray format);
+	AnimationFrames(const QSize &size): size(size){}
+
+public:
+	AnimationFrames(const AnimationFrames &) = delete;
+	AnimationFrames &operator=(const AnimationFrames &) = delete;
+	//Starts decoding on the global thread pool and returns immediately.
+	static std::shared_ptr<AnimationFrames> create(const QString &path, const QByteArray &format);
+	QSize get_size() const{
+		return this->size;
+	}
+	State get_state() const;
+	//Returns the index of the frame that should be displayed at the given
+	//time since playback started.
+	size_t find_frame(qint64 elapsed_ms) const;
+	//Must be called from the GUI thread. Returns a null pixmap if the frame
+	//isn't available.
+	QPixmap get_pixmap(size_t frame);
+	QImage get_image(size_t frame) const;
+};
+
+#endif // ANIMATIONFRAMES_H
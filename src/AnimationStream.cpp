@@ -0,0 +1,157 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "AnimationStream.h"
+#include <QImageReader>
+#include <QMutexLocker>
+#include <algorithm>
+
+AnimationStream::AnimationStream(const QString &path, const QByteArray &format, size_t capacity):
+		path(path),
+		format(format),
+		ring(std::max<size_t>(capacity, 2)){
+	this->worker = std::thread([this](){ this->worker_function(); });
+}
+
+AnimationStream::~AnimationStream(){
+	{
+		QMutexLocker lock(&this->mutex);
+		this->stop = true;
+		this->not_full.wakeAll();
+	}
+	this->worker.join();
+}
+
+void AnimationStream::clear_ring(){
+	for (size_t i = 0; i < this->count; i++)
+		this->ring[(this->head + i) % this->ring.size()].image = QImage();
+	this->head = 0;
+	this->count = 0;
+}
+
+//Blocks while the ring is full. Returns false if the frame was discarded
+//because of a seek or because the stream is being destroyed.
+bool AnimationStream::push(Frame &&frame){
+	QMutexLocker lock(&this->mutex);
+	while (this->count == this->ring.size() && !this->stop && this->seek_target < 0)
+		this->not_full.wait(&this->mutex);
+	if (this->stop || this->seek_target >= 0)
+		return false;
+	this->ring[(this->head + this->count) % this->ring.size()] = std::move(frame);
+	this->count++;
+	return true;
+}
+
+void AnimationStream::worker_function(){
+	std::unique_ptr<QImageReader> reader;
+	qint64 time = 0;
+	//Start of the current loop, in stream time.
+	qint64 loop_start = 0;
+	int loops_played = 0;
+	int loop_count = -1;
+	//Frames ending before this time are decoded but not queued.
+	qint64 skip_until = 0;
+	while (true){
+		{
+			QMutexLocker lock(&this->mutex);
+			if (this->stop)
+				return;
+			if (this->seek_target >= 0){
+				//The only way to seek in a generic QImageReader is to start
+				//over and decode up to the target.
+				skip_until = this->seek_target;
+				this->seek_target = -1;
+				this->finished = false;
+				reader.reset();
+				loop_start = skip_until;
+				if (this->loop_duration > 0)
+					loop_start -= skip_until % this->loop_duration;
+				else
+					loop_start = 0;
+				time = loop_start;
+				loops_played = this->loop_duration > 0 ? (int)(loop_start / this->loop_duration) : 0;
+			}
+			if (this->finished){
+				this->not_full.wait(&this->mutex);
+				continue;
+			}
+		}
+		if (!reader){
+			reader.reset(new QImageReader(this->path, this->format));
+			loop_count = reader->loopCount();
+		}
+		if (!reader->canRead()){
+			QMutexLocker lock(&this->mutex);
+			if (time == loop_start){
+				//Nothing could be decoded at all.
+				this->finished = true;
+				continue;
+			}
+			this->loop_duration = time - loop_start;
+			loops_played++;
+			//A negative loop count means the animation loops forever.
+			if (loop_count >= 0 && loops_played > loop_count){
+				this->finished = true;
+				continue;
+			}
+			reader.reset();
+			loop_start = time;
+			continue;
+		}
+		auto image = reader->read();
+		if (image.isNull()){
+			QMutexLocker lock(&this->mutex);
+			this->finished = true;
+			continue;
+		}
+		auto delay = reader->nextImageDelay();
+		if (delay <= 0)
+			delay = 100;
+		Frame frame;
+		frame.start_time = time;
+		frame.end_time = time + delay;
+		time = frame.end_time;
+		if (frame.end_time <= skip_until)
+			continue;
+		frame.image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+		this->push(std::move(frame));
+	}
+}
+
+void AnimationStream::seek(qint64 ms){
+	QMutexLocker lock(&this->mutex);
+	this->clear_ring();
+	this->seek_target = std::max<qint64>(ms, 0);
+	this->not_full.wakeAll();
+}
+
+bool AnimationStream::tick(qint64 elapsed_ms){
+	QMutexLocker lock(&this->mutex);
+	bool changed = false;
+	while (this->count){
+		auto &frame = this->ring[this->head];
+		if (frame.start_time > elapsed_ms)
+			break;
+		if (frame.end_time <= elapsed_ms && this->count > 1){
+			//Its time has already passed and there's something newer.
+			this->dropped_frames++;
+		}else{
+			if (frame.end_time <= elapsed_ms)
+				//Shown, but late.
+				this->dropped_frames++;
+			else
+				this->shown_frames++;
+			this->current = std::move(frame.image);
+			changed = true;
+		}
+		frame.image = QImage();
+		this->head = (this->head + 1) % this->ring.size();
+		this->count--;
+		this->not_full.wakeAll();
+	}
+	return changed;
+}
@@ -0,0 +1,81 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef ANIMATIONSTREAM_H
+#define ANIMATIONSTREAM_H
+
+#include <QString>
+#include <QByteArray>
+#include <QImage>
+#include <QMutex>
+#include <QWaitCondition>
+#include <memory>
+#include <thread>
+#include <vector>
+
+//Plays an animation that is too large to keep in memory. A dedicated thread
+//decodes ahead into a fixed-size ring of frames and blocks while the ring is
+//full. The GUI thread only ever takes frames that are already decoded.
+class AnimationStream{
+	struct Frame{
+		QImage image;
+		//Playback times, in milliseconds since the stream started. They keep
+		//growing across loops.
+		qint64 start_time;
+		qint64 end_time;
+	};
+
+	QString path;
+	QByteArray format;
+
+	QMutex mutex;
+	QWaitCondition not_full;
+	std::vector<Frame> ring;
+	size_t head = 0;
+	size_t count = 0;
+	bool stop = false;
+	bool finished = false;
+	//-1 if no seek is pending.
+	qint64 seek_target = -1;
+	//Length of one loop. Only known after the first pass.
+	qint64 loop_duration = -1;
+
+	QImage current;
+	qint64 dropped_frames = 0;
+	qint64 shown_frames = 0;
+
+	std::thread worker;
+
+	void worker_function();
+	bool push(Frame &&);
+	void clear_ring();
+
+public:
+	static const size_t default_capacity = 8;
+
+	AnimationStream(const QString &path, const QByteArray &format, size_t capacity = default_capacity);
+	AnimationStream(const AnimationStream &) = delete;
+	AnimationStream &operator=(const AnimationStream &) = delete;
+	~AnimationStream();
+	//Advances playback to the given time. Returns true if the current frame
+	//changed.
+	bool tick(qint64 elapsed_ms);
+	//Discards buffered frames and restarts decoding at the given time.
+	void seek(qint64 ms);
+	const QImage &get_current_frame() const{
+		return this->current;
+	}
+	//Frames that weren't ready by the end of their display time.
+	qint64 get_dropped_frames() const{
+		return this->dropped_frames;
+	}
+	qint64 get_shown_frames() const{
+		return this->shown_frames;
+	}
+};
+
+#endif // ANIMATIONSTREAM_H
@@ -0,0 +1,270 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "ColorAnalysis.h"
+#include <QtConcurrent/QtConcurrentRun>
+#include <QThreadPool>
+#include <vector>
+#include <algorithm>
+
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace{
+
+struct ColorSums{
+	//Sums of c * a for each channel, in B, G, R order.
+	quint64 sums[3];
+	quint64 pixels;
+
+	ColorSums(){
+		zero();
+	}
+	void zero(){
+		this->sums[0] = this->sums[1] = this->sums[2] = 0;
+		this->pixels = 0;
+	}
+	const ColorSums &operator+=(const ColorSums &other){
+		for (int i = 0; i < 3; i++)
+			this->sums[i] += other.sums[i];
+		this->pixels += other.pixels;
+		return *this;
+	}
+};
+
+void accumulate_scalar(ColorSums &dst, const uchar *p, int n){
+	quint64 b = 0, g = 0, r = 0;
+	for (int i = 0; i < n; i++){
+		quint64 a = p[3];
+		b += p[0] * a;
+		g += p[1] * a;
+		r += p[2] * a;
+		p += 4;
+	}
+	dst.sums[0] += b;
+	dst.sums[1] += g;
+	dst.sums[2] += r;
+}
+
+#ifdef USE_SSE2
+//Each iteration handles four pixels, and each 32-bit lane of the accumulator
+//(one per channel) receives one product of at most 255*255 from every pixel:
+//four products per iteration. 4 * 255*255 * 2^14 = 4261478400 < 2^32, so a
+//lane can't overflow within this many iterations.
+const int sse2_flush_interval = 1 << 14;
+
+void flush(ColorSums &dst, __m128i &acc){
+	alignas(16) quint32 lanes[4];
+	_mm_store_si128((__m128i *)lanes, acc);
+	for (int i = 0; i < 3; i++)
+		dst.sums[i] += lanes[i];
+	acc = _mm_setzero_si128();
+}
+
+void accumulate_row(ColorSums &dst, const uchar *p, int n){
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	int i = 0;
+	int pending = 0;
+	for (; i + 4 <= n; i += 4, p += 16){
+		//Pixels are stored as B, G, R, A bytes.
+		__m128i px = _mm_loadu_si128((const __m128i *)p);
+		__m128i lo = _mm_unpacklo_epi8(px, zero);
+		__m128i hi = _mm_unpackhi_epi8(px, zero);
+		__m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		__m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+		//255*255 fits in an unsigned 16-bit lane.
+		lo = _mm_mullo_epi16(lo, alo);
+		hi = _mm_mullo_epi16(hi, ahi);
+		acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(lo, zero));
+		acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(lo, zero));
+		acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(hi, zero));
+		acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(hi, zero));
+		if (++pending == sse2_flush_interval){
+			flush(dst, acc);
+			pending = 0;
+		}
+	}
+	flush(dst, acc);
+	accumulate_scalar(dst, p, n - i);
+}
+#else
+void accumulate_row(ColorSums &dst, const uchar *p, int n){
+	accumulate_scalar(dst, p, n);
+}
+#endif
+
+const quint32 alpha_mask = 0xFF000000;
+
+//Returns the index of the first pixel with non-zero alpha, or n.
+int find_first_opaque_scalar(const quint32 *p, int begin, int n){
+	for (int i = begin; i < n; i++)
+		if (p[i] & alpha_mask)
+			return i;
+	return n;
+}
+
+//Returns the index of the last pixel with non-zero alpha, or -1.
+int find_last_opaque_scalar(const quint32 *p, int n){
+	for (int i = n; i--;)
+		if (p[i] & alpha_mask)
+			return i;
+	return -1;
+}
+
+#ifdef USE_SSE2
+//Returns a mask with bit i set if pixel i of the four has non-zero alpha.
+int opaque_mask(const quint32 *p){
+	const __m128i mask = _mm_set1_epi32((int)alpha_mask);
+	__m128i px = _mm_and_si128(_mm_loadu_si128((const __m128i *)p), mask);
+	__m128i transparent = _mm_cmpeq_epi32(px, _mm_setzero_si128());
+	return ~_mm_movemask_ps(_mm_castsi128_ps(transparent)) & 0xF;
+}
+
+int find_first_opaque(const quint32 *p, int n){
+	int i = 0;
+	for (; i + 4 <= n; i += 4){
+		auto mask = opaque_mask(p + i);
+		if (mask){
+			while (!(mask & 1)){
+				mask >>= 1;
+				i++;
+			}
+			return i;
+		}
+	}
+	return find_first_opaque_scalar(p, i, n);
+}
+
+int find_last_opaque(const quint32 *p, int n){
+	int i = n;
+	for (; i >= 4; i -= 4){
+		auto mask = opaque_mask(p + i - 4);
+		if (mask){
+			int j = i - 1;
+			while (!(mask & 8)){
+				mask <<= 1;
+				j--;
+			}
+			return j;
+		}
+	}
+	return find_last_opaque_scalar(p, i);
+}
+#else
+int find_first_opaque(const quint32 *p, int n){
+	return find_first_opaque_scalar(p, 0, n);
+}
+
+int find_last_opaque(const quint32 *p, int n){
+	return find_last_opaque_scalar(p, n);
+}
+#endif
+
+ColorSums reduce_strip(const QImage &src, int y0, int y1, int row_step){
+	ColorSums ret;
+	auto w = src.width();
+	for (auto y = y0; y < y1; y += row_step){
+		accumulate_row(ret, src.constScanLine(y), w);
+		ret.pixels += w;
+	}
+	return ret;
+}
+
+}
+
+QColor get_average_color(QImage src, qint64 max_pixels){
+	if (src.isNull())
+		return QColor(0, 0, 0);
+	if (src.format() != QImage::Format_ARGB32 && src.format() != QImage::Format_RGB32)
+		src = src.convertToFormat(QImage::Format_ARGB32);
+
+	auto w = src.width();
+	auto h = src.height();
+	int row_step = 1;
+	if (max_pixels > 0 && (qint64)w * h > max_pixels)
+		row_step = (int)(((qint64)w * h + max_pixels - 1) / max_pixels);
+
+	auto threads = std::max(QThreadPool::globalInstance()->maxThreadCount(), 1);
+	//Don't bother splitting small images.
+	const qint64 min_strip_pixels = 1 << 16;
+	auto visited_rows = (h + row_step - 1) / row_step;
+	auto strips = (int)std::min<qint64>(threads, (qint64)visited_rows * w / min_strip_pixels);
+	strips = std::max(strips, 1);
+	auto rows_per_strip = (visited_rows + strips - 1) / strips * row_step;
+
+	ColorSums total;
+	if (strips == 1)
+		total = reduce_strip(src, 0, h, row_step);
+	else{
+		std::vector<QFuture<ColorSums>> futures;
+		futures.reserve(strips);
+		for (int y = 0; y < h; y += rows_per_strip){
+			auto y1 = std::min(y + rows_per_strip, h);
+			futures.push_back(QtConcurrent::run([&src, y, y1, row_step](){ return reduce_strip(src, y, y1, row_step); }));
+		}
+		for (auto &f : futures)
+			total += f.result();
+	}
+	if (!total.pixels)
+		return QColor(0, 0, 0);
+	auto divisor = total.pixels * 255;
+	return QColor(
+		(int)(total.sums[2] / divisor),
+		(int)(total.sums[1] / divisor),
+		(int)(total.sums[0] / divisor)
+	);
+}
+
+QRect get_opaque_bounds(QImage src){
+	if (src.isNull())
+		return QRect();
+	QRect full(QPoint(0, 0), src.size());
+	if (!src.hasAlphaChannel())
+		return full;
+	if (src.format() != QImage::Format_ARGB32 && src.format() != QImage::Format_ARGB32_Premultiplied)
+		src = src.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+	auto w = src.width();
+	auto h = src.height();
+	auto row = [&src](int y){ return (const quint32 *)src.constScanLine(y); };
+
+	int top = 0;
+	while (top < h && find_first_opaque(row(top), w) == w)
+		top++;
+	if (top == h)
+		return QRect();
+	int bottom = h - 1;
+	while (find_first_opaque(row(bottom), w) == w)
+		bottom--;
+
+	//Each row only needs to be scanned up to the bounds found so far.
+	int left = w;
+	int right = -1;
+	for (int y = top; y <= bottom && (left > 0 || right < w - 1); y++){
+		auto p = row(y);
+		left = std::min(left, find_first_opaque(p, left));
+		right = std::max(right, right + 1 + find_last_opaque(p + right + 1, w - right - 1));
+	}
+	return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+QColor get_background_color(const QImage &src, qint64 max_pixels){
+	QColor avg = get_average_color(src, max_pixels),
+		negative = avg,
+		background;
+	negative.setRedF(1 - negative.redF());
+	negative.setGreenF(1 - negative.greenF());
+	negative.setBlueF(1 - negative.blueF());
+	if (negative.saturationF() <= .05 && negative.valueF() >= .45 && negative.valueF() <= .55)
+		background = Qt::white;
+	else
+		background = negative;
+	return background;
+}
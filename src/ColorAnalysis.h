@@ -0,0 +1,30 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef COLORANALYSIS_H
+#define COLORANALYSIS_H
+
+#include <QImage>
+#include <QColor>
+
+//Images with more pixels than this are analyzed by sampling rows, rather
+//than by visiting every pixel.
+static const qint64 default_color_analysis_max_pixels = (qint64)1 << 24;
+
+//Averages the alpha-weighted color of the image. The work is split into
+//horizontal strips that are reduced concurrently on the global thread pool.
+//If max_pixels is positive and the image is larger, only evenly spaced rows
+//are visited.
+QColor get_average_color(QImage src, qint64 max_pixels = 0);
+//Picks a color that contrasts with the average color of the image.
+QColor get_background_color(const QImage &src, qint64 max_pixels = 0);
+//Returns the smallest rectangle that contains every pixel with non-zero
+//alpha, or a null rectangle if the image is fully transparent. Images
+//without an alpha channel return their full rectangle.
+QRect get_opaque_bounds(QImage src);
+
+#endif // COLORANALYSIS_H
@@ -0,0 +1,193 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "CommandClient.h"
+
+bool CommandClient::fail(const QString &message){
+	this->error = message;
+	return false;
+}
+
+bool CommandClient::open(const QString &server_name, int timeout, quint32 version){
+	this->close();
+	this->socket.connectToServer(server_name, QIODevice::ReadWrite);
+	if (!this->socket.waitForConnected(timeout))
+		return this->fail(this->socket.errorString());
+	this->socket.write(make_client_hello(version));
+	if (!this->flush(timeout))
+		return false;
+	QByteArray hello;
+	while (hello.size() < command_server_hello_size){
+		if (!this->socket.bytesAvailable() && !this->socket.waitForReadyRead(timeout))
+			return this->fail(this->socket.errorString());
+		hello.append(this->socket.read(command_server_hello_size - hello.size()));
+	}
+	this->version = parse_server_hello(hello, this->server_pid);
+	if (!this->version)
+		return this->fail("invalid server hello");
+	return true;
+}
+
+void CommandClient::write_frame(const QByteArray &frame){
+	if (this->timestamps)
+		this->socket.write(make_timestamped_frame(frame));
+	else
+		this->socket.write(frame);
+}
+
+void CommandClient::close(){
+	if (this->socket.state() != QLocalSocket::UnconnectedState){
+		this->socket.disconnectFromServer();
+		if (this->socket.state() != QLocalSocket::UnconnectedState)
+			this->socket.waitForDisconnected(default_timeout);
+	}
+	this->ring.reset();
+	this->reader = FrameReader();
+	this->replies.clear();
+	this->events.clear();
+	this->version = 0;
+	this->sent = this->received = 0;
+}
+
+quint32 CommandClient::send(const QStringList &command){
+	this->write_frame(make_command_frame(command));
+	return this->sent++;
+}
+
+quint32 CommandClient::send(BinaryCommandWriter &command){
+	this->write_frame(command.get_frame());
+	return this->sent++;
+}
+
+quint32 CommandClient::bind(quint32 target, const QString &name){
+	BinaryCommandWriter command(Opcode::Bind, target);
+	command.add_string(name);
+	return this->send(command);
+}
+
+quint32 CommandClient::send_batch(const std::vector<QStringList> &commands){
+	this->write_frame(make_batch_frame(commands));
+	return this->sent++;
+}
+
+bool CommandClient::flush(int timeout){
+	while (this->socket.bytesToWrite())
+		if (!this->socket.waitForBytesWritten(timeout))
+			return this->fail(this->socket.errorString());
+	return true;
+}
+
+quint32 CommandClient::subscribe(quint32 mask, const QString &target){
+	this->write_frame(make_subscribe_frame(mask, target));
+	return this->sent++;
+}
+
+bool CommandClient::read_frames(int timeout){
+	//Replies can't arrive for commands that are still sitting in our own
+	//buffer.
+	if (this->socket.bytesToWrite())
+		this->socket.waitForBytesWritten(0);
+	if (!this->socket.bytesAvailable() && !this->socket.waitForReadyRead(timeout))
+		return this->fail(this->socket.errorString());
+	this->reader.append(this->socket.readAll());
+	FrameType type;
+	QByteArray body;
+	while (this->reader.next(type, body)){
+		if (type == FrameType::Event){
+			CommandEvent event;
+			if (!parse_event_body(event, body))
+				return this->fail("malformed event");
+			this->events.push_back(std::move(event));
+			continue;
+		}
+		CommandReply reply;
+		bool ok;
+		if (type == FrameType::Reply)
+			ok = parse_reply_body(reply, body);
+		else if (type == FrameType::BatchReply)
+			ok = parse_batch_reply_body(reply, body);
+		else if (type == FrameType::BinaryReply)
+			ok = parse_binary_reply_body(reply, body);
+		else
+			continue;
+		if (!ok)
+			return this->fail("malformed reply");
+		this->replies.push_back(std::move(reply));
+	}
+	if (this->reader.has_error())
+		return this->fail("invalid frame");
+	return true;
+}
+
+bool CommandClient::receive(CommandReply &reply, int timeout){
+	while (this->replies.empty())
+		if (!this->read_frames(timeout))
+			return false;
+	reply = std::move(this->replies.front());
+	this->replies.pop_front();
+	this->received++;
+	return true;
+}
+
+bool CommandClient::wait_event(CommandEvent &event, int timeout){
+	while (this->events.empty())
+		if (!this->read_frames(timeout))
+			return false;
+	event = std::move(this->events.front());
+	this->events.pop_front();
+	return true;
+}
+
+bool CommandClient::execute(CommandResult &result, const QStringList &command, int timeout){
+	this->send(command);
+	if (!this->flush(timeout))
+		return false;
+	CommandReply reply;
+	if (!this->receive(reply, timeout))
+		return false;
+	result = reply.result;
+	return true;
+}
+
+bool CommandClient::get_clock(qint64 &dst, int timeout){
+	CommandResult result;
+	if (!this->execute(result, QStringList("clock"), timeout))
+		return false;
+	bool ok;
+	dst = result.message.toLongLong(&ok);
+	if (!result.success || !ok)
+		return this->fail("invalid clock reply");
+	return true;
+}
+
+bool CommandClient::open_ring(quint32 capacity, int timeout){
+	this->socket.write(make_open_ring_frame(capacity));
+	this->sent++;
+	if (!this->flush(timeout))
+		return false;
+	CommandReply reply;
+	if (!this->receive(reply, timeout))
+		return false;
+	if (!reply.result.success)
+		return this->fail(reply.result.message);
+	auto ring = std::make_unique<CommandRing>();
+	if (!ring->attach(reply.result.message))
+		return this->fail("can't attach to the ring");
+	this->ring = std::move(ring);
+	return true;
+}
+
+bool CommandClient::push(const RingCommand &command){
+	bool was_empty;
+	if (!this->ring->push(command, &was_empty))
+		return false;
+	if (was_empty){
+		this->socket.write(make_frame(FrameType::Doorbell, QByteArray()));
+		this->socket.flush();
+	}
+	return true;
+}
@@ -0,0 +1,103 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef COMMANDCLIENT_H
+#define COMMANDCLIENT_H
+
+#include "CommandProtocol.h"
+#include "CommandRing.h"
+#include <QtNetwork/QLocalSocket>
+#include <memory>
+#include <deque>
+
+//Client side of a persistent command connection. It only depends on QtCore
+//and QtNetwork and uses blocking socket calls, so it can be used from
+//threads and from programs without an event loop.
+class CommandClient{
+	QLocalSocket socket;
+	FrameReader reader;
+	quint32 version = 0;
+	qint64 server_pid = 0;
+	quint32 sent = 0;
+	quint32 received = 0;
+	QString error;
+	bool timestamps = false;
+	std::unique_ptr<CommandRing> ring;
+	//Frames that arrived while waiting for something else.
+	std::deque<CommandReply> replies;
+	std::deque<CommandEvent> events;
+
+	bool fail(const QString &);
+	void write_frame(const QByteArray &);
+	//Waits for at least one frame and queues everything that arrived.
+	bool read_frames(int timeout);
+public:
+	static const int default_timeout = 1000;
+
+	//Connects and performs the handshake.
+	bool open(const QString &server_name, int timeout = default_timeout, quint32 version = command_protocol_version);
+	void close();
+	//Stamps every command with its send time, so that the server's latency
+	//statistics include the time spent in transit.
+	void set_timestamps(bool enabled){
+		this->timestamps = enabled;
+	}
+	bool is_open() const{
+		return this->version != 0;
+	}
+	quint32 get_version() const{
+		return this->version;
+	}
+	qint64 get_server_pid() const{
+		return this->server_pid;
+	}
+	//Queues a command without waiting for its reply. Returns the command's
+	//sequence number.
+	quint32 send(const QStringList &command);
+	//Queues a binary command. Needs protocol version 2.
+	quint32 send(BinaryCommandWriter &command);
+	//Binds a binary target id to a window name.
+	quint32 bind(quint32 target, const QString &name);
+	//Queues a batch of commands, which count as a single command for the
+	//purposes of sequencing.
+	quint32 send_batch(const std::vector<QStringList> &commands);
+	//Writes everything that has been queued.
+	bool flush(int timeout = default_timeout);
+	//Blocks until the next reply arrives.
+	bool receive(CommandReply &, int timeout = default_timeout);
+	//Sends a command and waits for its reply. Only valid if no other replies
+	//are outstanding.
+	bool execute(CommandResult &, const QStringList &command, int timeout = default_timeout);
+	//Asks to receive the given events (see EventType) for a window name, a
+	//handle ("#<handle>"), or every window if the target is empty. The
+	//subscription is acknowledged with an ordinary reply.
+	quint32 subscribe(quint32 mask, const QString &target = {});
+	//Blocks until an event arrives. Replies that arrive in the meantime are
+	//kept for receive().
+	bool wait_event(CommandEvent &, int timeout = default_timeout);
+	//Reads the server clock that scheduled commands are timed against, in
+	//microseconds. Only valid if no other replies are outstanding.
+	bool get_clock(qint64 &, int timeout = default_timeout);
+	quint32 get_outstanding() const{
+		return this->sent - this->received;
+	}
+	//Asks the server for a shared memory ring and attaches to it. Only valid
+	//if no other replies are outstanding.
+	bool open_ring(quint32 capacity = CommandRing::default_capacity, int timeout = default_timeout);
+	//Pushes a command into the ring, ringing the doorbell if the server had
+	//already drained it. Returns false if the ring was full and the command
+	//was dropped. There is no reply.
+	bool push(const RingCommand &);
+	CommandRing *get_ring() const{
+		return this->ring.get();
+	}
+	const QString &get_error() const{
+		return this->error;
+	}
+};
+
+#endif // COMMANDCLIENT_H
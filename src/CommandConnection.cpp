@@ -0,0 +1,440 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "CommandConnection.h"
+#include <QDebug>
+#include <algorithm>
+#include <atomic>
+
+CommandConnection::CommandConnection(QLocalSocket *socket, dispatcher_t &&dispatcher, qint64 pid, const QByteArray &initial_data):
+		socket(socket),
+		dispatcher(std::move(dispatcher)),
+		pid(pid),
+		pending(initial_data){}
+
+CommandConnection::~CommandConnection(){
+	this->socket->disconnect();
+}
+
+void CommandConnection::start(){
+	QObject::connect(this->socket, &QLocalSocket::readyRead, [this](){ this->read(); });
+	QObject::connect(this->socket, &QLocalSocket::disconnected, [this](){ this->close(); });
+	this->receive_time = get_timestamp();
+	this->process();
+	if (this->socket->bytesAvailable())
+		this->read();
+}
+
+void CommandConnection::read(){
+	if (this->closed)
+		return;
+	this->receive_time = get_timestamp();
+	auto data = this->socket->readAll();
+	//The hello is parsed from pending, so frames only start after it.
+	if (this->mode == Mode::Persistent && this->version)
+		this->reader.append(data);
+	else
+		this->pending.append(data);
+	this->process();
+}
+
+void CommandConnection::process(){
+	if (this->mode == Mode::Undetermined){
+		if (this->pending.size() < (int)sizeof(command_protocol_magic))
+			return;
+		this->mode = starts_with_command_magic(this->pending) ? Mode::Persistent : Mode::Legacy;
+	}
+	if (this->mode == Mode::Legacy){
+		if (!this->process_legacy())
+			this->close();
+		return;
+	}
+	if (!this->version){
+		if (!this->process_hello())
+			this->close();
+		if (!this->version)
+			return;
+	}
+
+	FrameType type;
+	QByteArray body;
+	while (!this->closed && this->reader.next(type, body)){
+		qint64 sent = 0;
+		if (type == FrameType::Timestamped){
+			auto outer = body;
+			if (!parse_timestamped_body(sent, type, body, outer)){
+				qDebug() << "CommandConnection: invalid frame";
+				this->close();
+				return;
+			}
+		}
+		this->process_frame(type, body, sent);
+	}
+	if (this->reader.has_error()){
+		qDebug() << "CommandConnection: invalid frame";
+		this->close();
+	}
+}
+
+bool CommandConnection::process_legacy(){
+	if (this->legacy_timer)
+		//Already answered. Anything else the client sends is ignored.
+		return true;
+	auto size = get_legacy_message_size(this->pending);
+	if (size < 0){
+		qDebug() << "CommandConnection: invalid message";
+		return false;
+	}
+	if (!size)
+		return true;
+	this->legacy_command = parse_command_body(this->pending.left(size));
+	this->legacy_receive_time = this->receive_time;
+	this->pending.clear();
+	this->socket->write(QByteArray((const char *)&this->pid, sizeof(this->pid)));
+	this->legacy_timer = std::make_unique<QTimer>();
+	this->legacy_timer->setSingleShot(true);
+	QObject::connect(this->legacy_timer.get(), &QTimer::timeout, [this](){ this->close(); });
+	this->legacy_timer->start(legacy_timeout);
+	return true;
+}
+
+bool CommandConnection::process_hello(){
+	if (this->pending.size() < command_hello_size)
+		return true;
+	auto requested = parse_client_hello(this->pending);
+	if (!requested){
+		qDebug() << "CommandConnection: invalid hello";
+		return false;
+	}
+	this->version = std::min(requested, command_protocol_version);
+	this->socket->write(make_server_hello(this->version, this->pid));
+	this->reader.append(this->pending.mid(command_hello_size));
+	this->pending.clear();
+	return true;
+}
+
+//Opcode names as QStrings, so that recording statistics for binary commands
+//doesn't allocate.
+static const QString &get_opcode_qname(Opcode opcode){
+	static const std::vector<QString> names = [](){
+		std::vector<QString> ret;
+		for (size_t i = 0; i < (size_t)Opcode::Count; i++)
+			ret.push_back(QString::fromLatin1(get_opcode_name((Opcode)i)));
+		return ret;
+	}();
+	static const QString unknown;
+	auto i = (size_t)opcode;
+	return i < names.size() ? names[i] : unknown;
+}
+
+void CommandConnection::process_frame(FrameType type, const QByteArray &body, qint64 sent){
+	if (type == FrameType::Doorbell){
+		//Not a command, so it takes no sequence number and gets no reply.
+		this->drain_ring();
+		return;
+	}
+	CommandStats::Timing timing;
+	timing.sent = sent;
+	timing.received = this->receive_time;
+	timing.dispatched = get_timestamp();
+	if (this->stats)
+		this->stats->start_command();
+	//Command type for the statistics. Stays empty for requests that aren't
+	//commands.
+	QString name;
+	CommandReply reply;
+	reply.sequence = this->next_sequence++;
+	auto reply_type = FrameType::Reply;
+	switch (type){
+		case FrameType::Command:
+			{
+				auto args = parse_command_body(body);
+				if (args.isEmpty()){
+					reply.result = CommandResult(false, "malformed command");
+					break;
+				}
+				//Handlers expect the same layout as the command line.
+				args.prepend(QString());
+				name = args[1];
+				reply.result = this->dispatcher(args);
+			}
+			break;
+		case FrameType::Batch:
+			this->process_batch(reply, body);
+			name = "batch";
+			if (reply.result.success || !reply.batch_results.empty())
+				reply_type = FrameType::BatchReply;
+			break;
+		case FrameType::OpenRing:
+			if (this->version < command_binary_protocol_version){
+				reply.result = CommandResult(false, "rings need a newer protocol version");
+				break;
+			}
+			this->open_ring(reply, body);
+			break;
+		case FrameType::Subscribe:
+			this->subscribe(reply, body);
+			break;
+		case FrameType::Binary:
+			if (this->version < command_binary_protocol_version){
+				reply.result = CommandResult(false, "binary commands need a newer protocol version");
+				break;
+			}
+			{
+				BinaryCommand command;
+				if (!parse_binary_command(command, body.constData(), body.size())){
+					reply.result = CommandResult(false, "malformed binary command");
+				}else{
+					name = get_opcode_qname(command.opcode);
+					reply.result = this->execute_binary(command);
+				}
+			}
+			reply_type = FrameType::BinaryReply;
+			break;
+		default:
+			reply.result = CommandResult(false, "unknown frame type");
+			break;
+	}
+	if (this->stats && !name.isEmpty()){
+		timing.completed = get_timestamp();
+		this->stats->record(name, timing);
+	}
+	switch (reply_type){
+		case FrameType::BatchReply:
+			this->socket->write(make_batch_reply_frame(reply));
+			break;
+		case FrameType::BinaryReply:
+			this->socket->write(make_binary_reply_frame(reply));
+			break;
+		default:
+			this->socket->write(make_reply_frame(reply));
+			break;
+	}
+}
+
+CommandResult CommandConnection::execute_binary(const BinaryCommand &command){
+	//Ids are chosen by the client, so don't let it make the table huge.
+	const quint32 max_target = 1 << 16;
+	if (command.opcode == Opcode::Bind){
+		if (command.target >= max_target || command.operand_count != 1 || command.operands[0].type != OperandType::String)
+			return CommandResult(false, "invalid bind");
+		if (command.target >= this->targets.size())
+			this->targets.resize(command.target + 1);
+		auto &operand = command.operands[0];
+		this->targets[command.target].assign(operand.string, operand.string_size);
+		return CommandResult();
+	}
+	//Handle targets are resolved by the application.
+	static const std::string no_target;
+	auto by_handle = !!(command.flags & (quint16)CommandFlags::TargetIsHandle);
+	if (!by_handle && (command.target >= this->targets.size() || this->targets[command.target].empty()))
+		return CommandResult(false, "unbound target");
+	auto &target = by_handle ? no_target : this->targets[command.target];
+	if (command.flags & (quint16)CommandFlags::Scheduled)
+		return this->schedule_binary(command, target);
+	if (this->binary_dispatcher)
+		return this->binary_dispatcher(command, target);
+	auto args = command.to_QStringList(by_handle ? format_handle(command.target) : QString::fromStdString(target));
+	if (args.isEmpty())
+		return CommandResult(false, "unknown opcode");
+	args.prepend(QString());
+	return this->dispatcher(args);
+}
+
+//The command is copied, since it must outlive both the frame it came from
+//and possibly the connection. The target is resolved now, so rebinding it
+//later doesn't affect the command.
+CommandResult CommandConnection::schedule_binary(const BinaryCommand &command, const std::string &target){
+	if (!this->scheduler)
+		return CommandResult(false, "scheduling isn't supported");
+	auto log_failure = [](const CommandResult &result){
+		if (!result.success)
+			qDebug() << "CommandConnection: scheduled command failed:" << result.message;
+	};
+	auto copy = command;
+	copy.flags &= ~(quint16)CommandFlags::Scheduled;
+	bool has_strings = false;
+	for (int i = 0; i < copy.operand_count; i++)
+		has_strings |= copy.operands[i].type == OperandType::String;
+	if (this->binary_dispatcher && !has_strings){
+		auto dispatcher = this->binary_dispatcher;
+		this->scheduler(command.execute_at, [dispatcher, copy, target, log_failure](){
+			log_failure(dispatcher(copy, target));
+		}, get_opcode_qname(copy.opcode));
+		return CommandResult();
+	}
+	//String operands point into the frame, so keep the string form instead.
+	auto by_handle = !!(command.flags & (quint16)CommandFlags::TargetIsHandle);
+	auto args = command.to_QStringList(by_handle ? format_handle(command.target) : QString::fromStdString(target));
+	if (args.isEmpty())
+		return CommandResult(false, "unknown opcode");
+	args.prepend(QString());
+	auto dispatcher = this->dispatcher;
+	this->scheduler(command.execute_at, [dispatcher, args, log_failure](){
+		log_failure(dispatcher(args));
+	}, args[1]);
+	return CommandResult();
+}
+
+void CommandConnection::open_ring(CommandReply &reply, const QByteArray &body){
+	static std::atomic<int> next_ring_id(0);
+	quint32 capacity;
+	if (!parse_open_ring_body(capacity, body)){
+		reply.result = CommandResult(false, "malformed ring request");
+		return;
+	}
+	if (this->ring){
+		reply.result = CommandResult(false, "ring already open");
+		return;
+	}
+	auto key = QString("BorderlessRing_%1_%2").arg(this->pid).arg(next_ring_id++);
+	auto ring = std::make_unique<CommandRing>();
+	if (!ring->create(key, capacity)){
+		reply.result = CommandResult(false, "can't create shared memory");
+		return;
+	}
+	this->ring = std::move(ring);
+	this->ring_timer = std::make_unique<QTimer>();
+	this->ring_timer->setTimerType(Qt::PreciseTimer);
+	QObject::connect(this->ring_timer.get(), &QTimer::timeout, [this](){ this->drain_ring(); });
+	this->ring_timer->start(ring_poll_interval);
+	reply.result = CommandResult(true, key);
+}
+
+bool CommandConnection::Subscription::matches(const CommandEvent &event) const{
+	if (!(this->mask & get_event_bit(event.type)))
+		return false;
+	if (this->target.isEmpty())
+		return true;
+	if (this->handle)
+		return this->handle == event.handle;
+	return this->target == event.window;
+}
+
+void CommandConnection::subscribe(CommandReply &reply, const QByteArray &body){
+	Subscription subscription;
+	if (!parse_subscribe_body(subscription.mask, subscription.target, body)){
+		reply.result = CommandResult(false, "malformed subscription");
+		return;
+	}
+	subscription.mask &= all_events;
+	if (!parse_handle(subscription.handle, subscription.target))
+		subscription.handle = 0;
+	else if (!subscription.handle){
+		reply.result = CommandResult(false, "invalid handle");
+		return;
+	}
+	auto &v = this->subscriptions;
+	v.erase(std::remove_if(v.begin(), v.end(), [&](const Subscription &s){ return s.target == subscription.target; }), v.end());
+	if (subscription.mask)
+		v.push_back(subscription);
+}
+
+void CommandConnection::post_event(const CommandEvent &event){
+	if (this->closed || this->mode != Mode::Persistent)
+		return;
+	for (auto &subscription : this->subscriptions){
+		if (subscription.matches(event)){
+			this->socket->write(make_event_frame(event));
+			return;
+		}
+	}
+}
+
+void CommandConnection::drain_ring(){
+	if (!this->ring)
+		return;
+	auto drain = [this](){
+		RingCommand record;
+		BinaryCommand command;
+		CommandStats::Timing timing;
+		timing.received = get_timestamp();
+		//At most one ring's worth per call, so that a producer that keeps
+		//pushing can't starve the event loop.
+		for (auto n = this->ring->get_capacity(); n-- && this->ring->pop(record);){
+			record.to_binary(command);
+			this->ring_commands++;
+			timing.dispatched = get_timestamp();
+			if (this->stats)
+				this->stats->start_command();
+			if (!this->execute_binary(command).success)
+				this->ring_errors++;
+			if (this->stats){
+				timing.completed = get_timestamp();
+				this->stats->record(get_opcode_qname(command.opcode), timing);
+			}
+		}
+	};
+	if (this->group_runner)
+		this->group_runner(drain);
+	else
+		drain();
+	if (this->ring->is_corrupt()){
+		qDebug() << "CommandConnection: ring is corrupt, closing it after" << this->ring_commands << "commands";
+		//This may be running from the timer's own signal.
+		this->ring_timer->stop();
+		this->ring_timer.release()->deleteLater();
+		this->ring.reset();
+	}
+}
+
+void CommandConnection::process_batch(CommandReply &reply, const QByteArray &body){
+	std::vector<QStringList> commands;
+	if (!parse_batch_body(commands, body)){
+		reply.result = CommandResult(false, "malformed batch");
+		return;
+	}
+	for (auto &args : commands)
+		args.prepend(QString());
+	if (this->batch_dispatcher)
+		reply.batch_results = this->batch_dispatcher(commands);
+	else{
+		reply.batch_results.reserve(commands.size());
+		for (auto &args : commands)
+			reply.batch_results.push_back(this->dispatcher(args));
+	}
+	reply.result = summarize_batch(reply.batch_results);
+}
+
+void CommandConnection::run_legacy_command(){
+	if (this->legacy_command.isEmpty())
+		return;
+	auto args = std::move(this->legacy_command);
+	this->legacy_command.clear();
+	this->next_sequence++;
+	CommandStats::Timing timing;
+	timing.received = this->legacy_receive_time;
+	timing.dispatched = get_timestamp();
+	if (this->stats)
+		this->stats->start_command();
+	this->dispatcher(args);
+	if (this->stats && args.size() >= 2){
+		timing.completed = get_timestamp();
+		this->stats->record(args[1], timing);
+	}
+}
+
+void CommandConnection::close(){
+	if (this->closed)
+		return;
+	this->closed = true;
+	if (this->legacy_timer)
+		this->legacy_timer->stop();
+	if (this->ring){
+		this->ring_timer->stop();
+		this->drain_ring();
+	}
+	if (this->ring){
+		qDebug() << "CommandConnection: ring closed after" << this->ring_commands << "commands," << this->ring->get_dropped() << "dropped," << this->ring_errors << "failed";
+	}
+	this->socket->disconnect();
+	if (this->socket->state() != QLocalSocket::UnconnectedState)
+		this->socket->disconnectFromServer();
+	this->run_legacy_command();
+	if (this->on_closed)
+		this->on_closed();
+}
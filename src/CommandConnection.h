@@ -0,0 +1,148 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef COMMANDCONNECTION_H
+#define COMMANDCONNECTION_H
+
+#include "CommandProtocol.h"
+#include "CommandRing.h"
+#include "CommandStats.h"
+#include <QtNetwork/QLocalSocket>
+#include <QTimer>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+//Server side of a command connection. Nothing in here ever blocks: data is
+//accumulated as it arrives and processed once enough of it is available.
+//
+//The first bytes decide what kind of connection it is. Persistent
+//connections have their commands executed as soon as their frames are
+//complete, and their replies are queued on the socket without waiting for
+//them to be written. Single-command connections are answered with the PID
+//as soon as the command is complete, and the command is executed once the
+//client disconnects (or after a timeout), as the old blocking server did.
+class CommandConnection{
+public:
+	typedef std::function<CommandResult(const QStringList &)> dispatcher_t;
+	typedef std::function<std::vector<CommandResult>(const std::vector<QStringList> &)> batch_dispatcher_t;
+	typedef std::function<CommandResult(const BinaryCommand &, const std::string &target)> binary_dispatcher_t;
+	//Runs the function passed to it. Used to let the application treat a
+	//group of commands as a unit.
+	typedef std::function<void(const std::function<void()> &)> group_runner_t;
+	//Runs the function, a command of the given type, once the server clock
+	//reaches the time.
+	typedef std::function<void(qint64, std::function<void()> &&, const QString &type)> scheduler_t;
+private:
+	enum class Mode{
+		Undetermined,
+		Legacy,
+		Persistent,
+	};
+	struct Subscription{
+		quint32 mask;
+		//Empty for every window.
+		QString target;
+		//Non-zero if the target was given as a handle.
+		quint32 handle;
+
+		bool matches(const CommandEvent &) const;
+	};
+
+	QLocalSocket *socket;
+	dispatcher_t dispatcher;
+	batch_dispatcher_t batch_dispatcher;
+	binary_dispatcher_t binary_dispatcher;
+	group_runner_t group_runner;
+	scheduler_t scheduler;
+	//Window names bound to binary target ids, indexed by id.
+	std::vector<std::string> targets;
+	qint64 pid;
+	Mode mode = Mode::Undetermined;
+	//Data received before the mode is known, or before a legacy message is
+	//complete.
+	QByteArray pending;
+	FrameReader reader;
+	quint32 version = 0;
+	quint32 next_sequence = 0;
+	QStringList legacy_command;
+	std::unique_ptr<QTimer> legacy_timer;
+	std::unique_ptr<CommandRing> ring;
+	std::unique_ptr<QTimer> ring_timer;
+	quint64 ring_commands = 0;
+	quint64 ring_errors = 0;
+	std::vector<Subscription> subscriptions;
+	CommandStats *stats = nullptr;
+	//When the data being processed was read.
+	qint64 receive_time = 0;
+	qint64 legacy_receive_time = 0;
+	bool closed = false;
+
+	void read();
+	void process();
+	bool process_legacy();
+	bool process_hello();
+	//sent is the client's send time, or 0 if it's unknown.
+	void process_frame(FrameType, const QByteArray &, qint64 sent);
+	void process_batch(CommandReply &, const QByteArray &);
+	CommandResult execute_binary(const BinaryCommand &);
+	CommandResult schedule_binary(const BinaryCommand &, const std::string &target);
+	void open_ring(CommandReply &, const QByteArray &);
+	void subscribe(CommandReply &, const QByteArray &);
+	void drain_ring();
+	void run_legacy_command();
+	void close();
+public:
+	//How long a single-command client is given to disconnect after
+	//receiving the PID.
+	static const int legacy_timeout = 1000;
+	//How often an open ring is checked for commands, in milliseconds. The
+	//same as the viewports' animation timer, so polling doesn't add wakeups
+	//while anything is animating. Doorbells wake the server up sooner.
+	static const int ring_poll_interval = 10;
+
+	//Called once the connection has ended, either because the client
+	//disconnected or because it violated the protocol. The connection must
+	//not be destroyed from within the callback.
+	std::function<void()> on_closed;
+
+	//initial_data contains whatever was already read from the socket.
+	CommandConnection(QLocalSocket *socket, dispatcher_t &&dispatcher, qint64 pid, const QByteArray &initial_data = {});
+	~CommandConnection();
+	//If not set, the commands in a batch are passed to the dispatcher one by
+	//one.
+	void set_batch_dispatcher(batch_dispatcher_t &&dispatcher){
+		this->batch_dispatcher = std::move(dispatcher);
+	}
+	//If not set, binary commands are converted to string commands.
+	void set_binary_dispatcher(binary_dispatcher_t &&dispatcher){
+		this->binary_dispatcher = std::move(dispatcher);
+	}
+	void set_group_runner(group_runner_t &&runner){
+		this->group_runner = std::move(runner);
+	}
+	void set_stats(CommandStats *stats){
+		this->stats = stats;
+	}
+	//If not set, scheduled binary commands are rejected.
+	void set_scheduler(scheduler_t &&scheduler){
+		this->scheduler = std::move(scheduler);
+	}
+	//Processes initial_data and starts listening to the socket.
+	void start();
+	QLocalSocket *get_socket() const{
+		return this->socket;
+	}
+	quint32 get_commands_processed() const{
+		return this->next_sequence;
+	}
+	//Sends the event to the client if it subscribed to it.
+	void post_event(const CommandEvent &);
+};
+
+#endif // COMMANDCONNECTION_H
@@ -9,119 +9,377 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "MainWindow.h"
 #include "Script.h"
 #include <sstream>
+#include <QDebug>
+#include <QTimer>
 
-void ImageViewerApplication::handle_load(const QStringList &args){
+//Accepts either a scale ("0.05") or a bounding size ("320x240").
+DecodeHint parse_decode_hint(const QString &s){
+	auto i = s.indexOf('x', 0, Qt::CaseInsensitive);
+	if (i < 0)
+		return DecodeHint(expect_real(s));
+	auto w = expect_integer(s.mid(0, i));
+	auto h = expect_integer(s.mid(i + 1));
+	return DecodeHint(QSize(w, h));
+}
+
+//Names that look like handles, groups or patterns would be ambiguous.
+std::string ImageViewerApplication::get_new_window_name(const QString &name){
+	if (name.startsWith('#') || name.startsWith('%'))
+		throw CommandException("window names can't start with '#' or '%'");
+	if (is_window_pattern(name))
+		throw CommandException("window names can't contain '*' or '?'");
+	return name.toStdString();
+}
+
+static CommandResult load_result(quint32 handle){
+	if (!handle)
+		return CommandResult(false, "can't load");
+	return CommandResult(true, QString::number(handle));
+}
+
+CommandResult ImageViewerApplication::handle_load(const QStringList &args){
 	if (args.size() < 4)
-		return;
-	this->main_window->load(args[2], args[3].toStdString());
+		return CommandResult(false, "not enough arguments");
+	DecodeHint hint;
+	if (args.size() >= 5)
+		hint = parse_decode_hint(args[4]);
+	return load_result(this->main_window->load(args[2], get_new_window_name(args[3]), hint));
+}
+
+CommandResult ImageViewerApplication::handle_loadsheet(const QStringList &args){
+	if (args.size() < 5)
+		return CommandResult(false, "not enough arguments");
+	auto layout = SpriteSheetLayout::parse(args[4]);
+	double fps = 0;
+	if (args.size() >= 6)
+		fps = expect_real(args[5]);
+	return load_result(this->main_window->load_sprite_sheet(args[2], get_new_window_name(args[3]), layout, fps));
+}
+
+CommandResult ImageViewerApplication::handle_loadflipbook(const QStringList &args){
+	if (args.size() < 5)
+		return CommandResult(false, "not enough arguments");
+	auto fps = expect_real(args[4]);
+	size_t lookahead = LoadedFlipbook::default_lookahead;
+	if (args.size() >= 6)
+		lookahead = std::max(expect_integer(args[5]), 1);
+	return load_result(this->main_window->load_flipbook(args[2], get_new_window_name(args[3]), fps, lookahead));
 }
 
-void ImageViewerApplication::handle_scale(const QStringList &args){
+//"loadraw <key> <name> <width> <height> <stride> [argb32|premultiplied]"
+//displays 32-bit pixels from the shared memory segment with the given key.
+//The default format is non-premultiplied ARGB32; premultiplied pixels are
+//cheaper to draw. Command logs only hold the key, not the pixels.
+CommandResult ImageViewerApplication::handle_loadraw(const QStringList &args){
+	if (args.size() < 7)
+		return CommandResult(false, "not enough arguments");
+	QSize size(expect_integer(args[4]), expect_integer(args[5]));
+	auto stride = expect_integer(args[6]);
+	if (size.isEmpty())
+		return CommandResult(false, "invalid size");
+	if (stride < (qint64)size.width() * 4 || stride % 4)
+		return CommandResult(false, "invalid stride");
+	auto format = QImage::Format_ARGB32;
+	if (args.size() >= 8){
+		if (args[7] == "premultiplied")
+			format = QImage::Format_ARGB32_Premultiplied;
+		else if (args[7] != "argb32")
+			return CommandResult(false, "unknown pixel format: " + args[7]);
+	}
+	return load_result(this->main_window->load_raw(args[2], get_new_window_name(args[3]), size, stride, format));
+}
+
+CommandResult ImageViewerApplication::handle_scale(const QStringList &args){
 	if (args.size() < 4)
-		return;
-	auto name = args[2].toStdString();
+		return CommandResult(false, "not enough arguments");
 	auto scale = expect_real(args[3]);
-	auto window = this->main_window->get_window(name);
-	if (!window)
-		return;
-	window->set_scale(scale);
+	auto main_window = this->main_window.get();
+	main_window->for_each_window(args[2], [main_window, scale](ImageViewport &window){
+		main_window->queue_scale(window, scale);
+	});
+	return CommandResult();
 }
 
-void ImageViewerApplication::handle_setorigin(const QStringList &args){
+CommandResult ImageViewerApplication::handle_setorigin(const QStringList &args){
 	if (args.size() < 5)
-		return;
-	auto name = args[2].toStdString();
+		return CommandResult(false, "not enough arguments");
 	auto x = expect_integer(args[3]);
 	auto y = expect_integer(args[4]);
-	auto window = this->main_window->get_window(name);
-	if (!window)
-		return;
-	window->set_origin(x, y);
+	this->main_window->for_each_window(args[2], [x, y](ImageViewport &window){
+		window.set_origin(x, y);
+	});
+	return CommandResult();
 }
 
-void ImageViewerApplication::handle_move(const QStringList &args){
+CommandResult ImageViewerApplication::handle_move(const QStringList &args){
 	if (args.size() < 5)
-		return;
-	auto name = args[2].toStdString();
+		return CommandResult(false, "not enough arguments");
 	auto x = expect_relabs_integer(args[3]);
 	auto y = expect_relabs_integer(args[4]);
 
-	auto window = this->main_window->get_window(name);
-	if (!window)
-		return;
-	window->move_by_command(set(window->get_position(), x, y));
+	auto main_window = this->main_window.get();
+	main_window->for_each_window(args[2], [main_window, &x, &y](ImageViewport &window){
+		main_window->queue_move(window, x, y);
+	});
+	return CommandResult();
 }
 
-void ImageViewerApplication::handle_rotate(const QStringList &args){
+CommandResult ImageViewerApplication::handle_rotate(const QStringList &args){
 	if (args.size() < 4)
-		return;
-	auto name = args[2].toStdString();
+		return CommandResult(false, "not enough arguments");
 	auto theta = expect_relabs_real(args[3]);
 
-	auto window = this->main_window->get_window(name);
-	if (!window)
-		return;
-	auto rotation = window->get_rotation();
-	if (theta.second)
-		rotation += theta.first;
-	else
-		rotation = theta.first;
-	window->set_rotation(rotation);
+	auto main_window = this->main_window.get();
+	main_window->for_each_window(args[2], [main_window, &theta](ImageViewport &window){
+		main_window->queue_rotation(window, theta);
+	});
+	return CommandResult();
 }
 
-void ImageViewerApplication::handle_animmove(const QStringList &args){
+CommandResult ImageViewerApplication::handle_animmove(const QStringList &args){
 	if (args.size() < 6)
-		return;
-	auto name = args[2].toStdString();
+		return CommandResult(false, "not enough arguments");
 	auto x = expect_integer(args[3]);
 	auto y = expect_integer(args[4]);
 	auto speed = expect_real(args[5]);
 
-	auto window = this->main_window->get_window(name);
-	if (!window)
-		return;
-	window->anim_move(x, y, speed);
+	this->main_window->for_each_window(args[2], [x, y, speed](ImageViewport &window){
+		window.anim_move(x, y, speed);
+	});
+	return CommandResult();
 }
 
-void ImageViewerApplication::handle_animrotate(const QStringList &args){
+CommandResult ImageViewerApplication::handle_animrotate(const QStringList &args){
 	if (args.size() < 4)
-		return;
-	auto name = args[2].toStdString();
+		return CommandResult(false, "not enough arguments");
 	auto speed = expect_real(args[3]);
 
-	auto window = this->main_window->get_window(name);
-	if (!window)
-		return;
-	window->anim_rotate(speed);
+	this->main_window->for_each_window(args[2], [speed](ImageViewport &window){
+		window.anim_rotate(speed);
+	});
+	return CommandResult();
 }
 
-void ImageViewerApplication::handle_fliph(const QStringList &args){
-	if (args.size() < 2)
-		return;
-	auto name = args[2].toStdString();
-	auto window = this->main_window->get_window(name);
-	if (!window)
-		return;
-	window->fliph();
+CommandResult ImageViewerApplication::handle_fliph(const QStringList &args){
+	if (args.size() < 3)
+		return CommandResult(false, "not enough arguments");
+	this->main_window->for_each_window(args[2], [](ImageViewport &window){
+		window.fliph();
+	});
+	return CommandResult();
 }
 
-void ImageViewerApplication::handle_flipv(const QStringList &args){
+CommandResult ImageViewerApplication::handle_flipv(const QStringList &args){
 	if (args.size() < 3)
-		return;
-	auto name = args[2].toStdString();
-	auto window = this->main_window->get_window(name);
-	if (!window)
-		return;
-	window->flipv();
+		return CommandResult(false, "not enough arguments");
+	this->main_window->for_each_window(args[2], [](ImageViewport &window){
+		window.flipv();
+	});
+	return CommandResult();
 }
 
-void ImageViewerApplication::handle_loadscript(const QStringList &args){
+CommandResult ImageViewerApplication::handle_loadscript(const QStringList &args){
 	if (args.size() < 4)
-		return;
-	auto name = args[2].toStdString();
+		return CommandResult(false, "not enough arguments");
 	auto &path = args[3];
-	auto window = this->main_window->get_window(name);
+	this->main_window->for_each_window(args[2], [&path](ImageViewport &window){
+		window.load_script(path);
+	});
+	return CommandResult();
+}
+
+//"unload <target>" closes the windows and frees their images; for loadraw
+//windows, that detaches the shared memory segment. Replies with how many
+//windows were closed.
+CommandResult ImageViewerApplication::handle_unload(const QStringList &args){
+	if (args.size() < 3)
+		return CommandResult(false, "not enough arguments");
+	return CommandResult(true, QString::number(this->main_window->unload(args[2])));
+}
+
+//"group create <group>", "group delete <group>", "group add <group> <target>"
+//and "group remove <group> <target>". Adding and removing reply with how
+//many windows were affected. Commands address a group as "%<group>".
+CommandResult ImageViewerApplication::handle_group(const QStringList &args){
+	if (args.size() < 4)
+		return CommandResult(false, "not enough arguments");
+	auto &action = args[2];
+	auto group = args[3].toStdString();
+	if (action == "create"){
+		if (!this->main_window->create_group(group))
+			return CommandResult(false, "group already exists");
+		return CommandResult();
+	}
+	if (action == "delete"){
+		if (!this->main_window->delete_group(group))
+			return CommandResult(false, "no such group");
+		return CommandResult();
+	}
+	if (action != "add" && action != "remove")
+		return CommandResult(false, "unknown group action: " + action);
+	if (args.size() < 5)
+		return CommandResult(false, "not enough arguments");
+	size_t count;
+	if (action == "add")
+		count = this->main_window->add_to_group(group, args[4]);
+	else
+		count = this->main_window->remove_from_group(group, args[4]);
+	return CommandResult(true, QString::number(count));
+}
+
+//"at <time> <command...>" runs the command once the server clock reaches the
+//time. Commands scheduled for the same time start in the same frame.
+CommandResult ImageViewerApplication::handle_at(const QStringList &args){
+	if (args.size() < 4)
+		return CommandResult(false, "not enough arguments");
+	bool ok;
+	auto time = args[2].toLongLong(&ok);
+	if (!ok)
+		throw ParserException("expected a time but found " + args[2].toStdString());
+	auto command = args.mid(3);
+	command.prepend(args[0]);
+	//Catch mistakes while the client can still be told about them.
+	if (command[1] != "batch" && !this->command_handlers.count(command[1].toStdString()))
+		return CommandResult(false, "unknown command: " + command[1]);
+	this->schedule(time, [this, command](){
+		auto result = this->new_instance(command);
+		if (!result.success)
+			qDebug() << "scheduled command failed:" << result.message;
+	}, command[1]);
+	return CommandResult();
+}
+
+//Replies with the server clock, in microseconds.
+CommandResult ImageViewerApplication::handle_clock(const QStringList &){
+	return CommandResult(true, QString::number(this->get_clock()));
+}
+
+//"stats" replies with the latency statistics of every command type so far;
+//"stats reset" clears them.
+CommandResult ImageViewerApplication::handle_stats(const QStringList &args){
+	auto &stats = this->get_command_stats();
+	if (args.size() >= 3){
+		if (args[2] != "reset")
+			return CommandResult(false, "unknown stats action: " + args[2]);
+		stats.reset();
+		return CommandResult();
+	}
+	return CommandResult(true, stats.report());
+}
+
+CommandResult ImageViewerApplication::handle_quit(const QStringList &){
+	//Let the reply go out first.
+	QTimer::singleShot(0, this, [this](){ this->quit(); });
+	return CommandResult();
+}
+
+//"record <path>" starts recording every command into a command log, which
+//"Borderless --replay <path>" can play back. "record stop" stops.
+CommandResult ImageViewerApplication::handle_record(const QStringList &args){
+	if (args.size() < 3)
+		return CommandResult(false, "not enough arguments");
+	if (args[2] == "stop"){
+		if (!this->recorder.is_open())
+			return CommandResult(false, "not recording");
+		auto good = this->recorder.good();
+		this->recorder.close();
+		if (!good)
+			return CommandResult(false, "the command log is incomplete, a write failed");
+		return CommandResult();
+	}
+	if (!this->start_recording(args[2]))
+		return CommandResult(false, "can't create " + args[2]);
+	return CommandResult();
+}
+
+//Fast path for the commands that controllers send at high rates. Their
+//operands are already numbers, so nothing needs to be parsed or allocated.
+//Everything else goes through the string handlers.
+CommandResult ImageViewerApplication::new_binary_instance(const BinaryCommand &command, const std::string &target){
+	if (!this->command_depth && this->recorder.is_open()){
+		auto by_handle = !!(command.flags & (quint16)CommandFlags::TargetIsHandle);
+		auto args = command.to_QStringList(by_handle ? format_handle(command.target) : QString::fromStdString(target));
+		if (!args.isEmpty())
+			this->record(args);
+	}
+	auto depth = autoset(this->command_depth, this->command_depth + 1);
+	int min_operands;
+	switch (command.opcode){
+		case Opcode::Scale:
+		case Opcode::Rotate:
+		case Opcode::AnimRotate:
+			min_operands = 1;
+			break;
+		case Opcode::SetOrigin:
+		case Opcode::Move:
+			min_operands = 2;
+			break;
+		case Opcode::AnimMove:
+			min_operands = 3;
+			break;
+		case Opcode::FlipH:
+		case Opcode::FlipV:
+			min_operands = 0;
+			break;
+		default:
+			return SingleInstanceApplication::new_binary_instance(command, target);
+	}
+	if (command.operand_count < min_operands)
+		return CommandResult(false, "not enough operands");
+	for (int i = 0; i < min_operands; i++)
+		if (!command.operands[i].is_number())
+			return CommandResult(false, "expected a number");
+
+	auto &o = command.operands;
+	auto main_window = this->main_window.get();
+	auto apply = [&command, &o, main_window](ImageViewport &window){
+		switch (command.opcode){
+			case Opcode::Scale:
+				main_window->queue_scale(window, o[0].to_double());
+				break;
+			case Opcode::SetOrigin:
+				window.set_origin(o[0].to_int(), o[1].to_int());
+				break;
+			case Opcode::Move:
+				main_window->queue_move(window, relabsint(o[0].to_int(), o[0].relative), relabsint(o[1].to_int(), o[1].relative));
+				break;
+			case Opcode::Rotate:
+				main_window->queue_rotation(window, relabsdouble(o[0].to_double(), o[0].relative));
+				break;
+			case Opcode::AnimMove:
+				window.anim_move(o[0].to_int(), o[1].to_int(), o[2].to_double());
+				break;
+			case Opcode::AnimRotate:
+				window.anim_rotate(o[0].to_double());
+				break;
+			case Opcode::FlipH:
+				window.fliph();
+				break;
+			case Opcode::FlipV:
+				window.flipv();
+				break;
+			default:
+				break;
+		}
+	};
+
+	MainWindow::sharedp_t window;
+	if (command.flags & (quint16)CommandFlags::TargetIsHandle)
+		window = this->main_window->get_window(command.target);
+	else if (!target.empty() && target[0] != '#' && target[0] != '%' && target.find_first_of("*?") == target.npos)
+		window = this->main_window->get_window(target);
+	else{
+		//Bound to a group or a pattern.
+		try{
+			this->main_window->for_each_window(QString::fromStdString(target), apply);
+		}catch (CommandException &e){
+			return CommandResult(false, e.what());
+		}
+		return CommandResult();
+	}
 	if (!window)
-		return;
-	window->load_script(path);
+		return CommandResult(false, "no such window");
+	this->get_command_stats().touch(window->get_handle());
+	apply(*window);
+	return CommandResult();
 }
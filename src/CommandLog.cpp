@@ -0,0 +1,119 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "CommandLog.h"
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+
+namespace{
+
+const char command_log_magic[] = { 'B', 'L', 'C', 'M', 'D', 'L', 'O', 'G' };
+//Sanity limits, so that a damaged log doesn't make the reader allocate
+//absurd amounts of memory.
+const quint64 max_arguments = 1 << 16;
+const quint64 max_argument_size = 1 << 24;
+
+void append_varint(QByteArray &dst, quint64 x){
+	do{
+		auto byte = (char)(x & 0x7F);
+		x >>= 7;
+		if (x)
+			byte |= 0x80;
+		dst.append(byte);
+	}while (x);
+}
+
+}
+
+bool CommandLogWriter::open(const QString &path, qint64 start_time){
+	this->close();
+	this->file.setFileName(path);
+	if (!this->file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return false;
+	uchar version[4];
+	qToBigEndian(CommandLogWriter::version, version);
+	this->failed =
+		this->file.write(command_log_magic, sizeof(command_log_magic)) != sizeof(command_log_magic) ||
+		this->file.write((const char *)version, sizeof(version)) != sizeof(version);
+	this->last_time = start_time;
+	return !this->failed;
+}
+
+void CommandLogWriter::write(qint64 time, const QStringList &command){
+	if (!this->file.isOpen())
+		return;
+	QByteArray record;
+	append_varint(record, (quint64)std::max<qint64>(time - this->last_time, 0));
+	this->last_time = std::max(time, this->last_time);
+	append_varint(record, (quint64)command.size());
+	for (auto &s : command){
+		auto utf8 = s.toUtf8();
+		append_varint(record, (quint64)utf8.size());
+		record.append(utf8);
+	}
+	if (this->file.write(record) != record.size())
+		this->failed = true;
+}
+
+void CommandLogWriter::close(){
+	if (this->file.isOpen())
+		this->file.close();
+}
+
+bool CommandLogReader::open(const QString &path, QString &error){
+	this->file.setFileName(path);
+	if (!this->file.open(QIODevice::ReadOnly)){
+		error = this->file.errorString();
+		return false;
+	}
+	char header[sizeof(command_log_magic) + 4];
+	if (this->file.read(header, sizeof(header)) != sizeof(header) || memcmp(header, command_log_magic, sizeof(command_log_magic))){
+		error = "not a command log";
+		return false;
+	}
+	auto version = qFromBigEndian<quint32>((const uchar *)header + sizeof(command_log_magic));
+	if (version != CommandLogWriter::version){
+		error = QString("unsupported command log version %1").arg(version);
+		return false;
+	}
+	this->time = 0;
+	return true;
+}
+
+bool CommandLogReader::read_varint(quint64 &dst){
+	dst = 0;
+	for (int shift = 0; shift < 64; shift += 7){
+		char byte;
+		if (!this->file.getChar(&byte))
+			return false;
+		dst |= (quint64)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool CommandLogReader::read(qint64 &time, QStringList &command){
+	quint64 delta, count;
+	if (!this->read_varint(delta) || !this->read_varint(count) || count > max_arguments)
+		return false;
+	command.clear();
+	command.reserve((int)count);
+	while (count--){
+		quint64 size;
+		if (!this->read_varint(size) || size > max_argument_size)
+			return false;
+		auto utf8 = this->file.read((qint64)size);
+		if ((quint64)utf8.size() != size)
+			return false;
+		command << QString::fromUtf8(utf8);
+	}
+	this->time += (qint64)delta;
+	time = this->time;
+	return true;
+}
@@ -0,0 +1,60 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef COMMANDLOG_H
+#define COMMANDLOG_H
+
+#include <QFile>
+#include <QStringList>
+
+//Binary log of the commands a server executed, so that a session can be
+//replayed later. The file starts with the magic "BLCMDLOG" and a 32-bit
+//big endian version. Each record is the time since the previous record in
+//microseconds, the number of arguments and every argument as a length and
+//its UTF-8 bytes. Every number in a record is a LEB128 varint, so a typical
+//command takes a few bytes more than its text.
+class CommandLogWriter{
+	QFile file;
+	qint64 last_time = 0;
+	bool failed = false;
+public:
+	static const quint32 version = 1;
+
+	~CommandLogWriter(){
+		this->close();
+	}
+	//Truncates the file.
+	bool open(const QString &path, qint64 start_time);
+	//time is monotonic, in microseconds. command doesn't include the
+	//program name.
+	void write(qint64 time, const QStringList &command);
+	void close();
+	bool is_open() const{
+		return this->file.isOpen();
+	}
+	QString get_path() const{
+		return this->file.fileName();
+	}
+	//False if a write failed since the log was opened.
+	bool good() const{
+		return !this->failed;
+	}
+};
+
+class CommandLogReader{
+	QFile file;
+	qint64 time = 0;
+
+	bool read_varint(quint64 &);
+public:
+	bool open(const QString &path, QString &error);
+	//time is relative to the start of the recording. Returns false at the
+	//end of the log or if the log is damaged.
+	bool read(qint64 &time, QStringList &command);
+};
+
+#endif // COMMANDLOG_H
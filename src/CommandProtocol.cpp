@@ -0,0 +1,509 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "CommandProtocol.h"
+#include <QDataStream>
+#include <QtEndian>
+#include <cstring>
+#include <chrono>
+
+namespace{
+
+void append_u32(QByteArray &dst, quint32 x){
+	uchar buffer[4];
+	qToBigEndian(x, buffer);
+	dst.append((const char *)buffer, sizeof(buffer));
+}
+
+quint32 read_u32(const char *p){
+	return qFromBigEndian<quint32>((const uchar *)p);
+}
+
+quint16 read_u16(const char *p){
+	return qFromBigEndian<quint16>((const uchar *)p);
+}
+
+void append_u16(QByteArray &dst, quint16 x){
+	uchar buffer[2];
+	qToBigEndian(x, buffer);
+	dst.append((const char *)buffer, sizeof(buffer));
+}
+
+void write_u32(QByteArray &dst, int offset, quint32 x){
+	qToBigEndian(x, (uchar *)dst.data() + offset);
+}
+
+const int binary_header_size = 9;
+
+}
+
+bool starts_with_command_magic(const QByteArray &data){
+	return data.size() >= (int)sizeof(command_protocol_magic) && !memcmp(data.constData(), command_protocol_magic, sizeof(command_protocol_magic));
+}
+
+QByteArray make_client_hello(quint32 version){
+	QByteArray ret(command_protocol_magic, sizeof(command_protocol_magic));
+	append_u32(ret, version);
+	return ret;
+}
+
+QByteArray make_server_hello(quint32 version, qint64 pid){
+	auto ret = make_client_hello(version);
+	append_u32(ret, (quint32)((quint64)pid >> 32));
+	append_u32(ret, (quint32)pid);
+	return ret;
+}
+
+quint32 parse_client_hello(const QByteArray &data){
+	if (data.size() < command_hello_size || !starts_with_command_magic(data))
+		return 0;
+	return read_u32(data.constData() + 4);
+}
+
+quint32 parse_server_hello(const QByteArray &data, qint64 &pid){
+	if (data.size() < command_server_hello_size)
+		return 0;
+	auto ret = parse_client_hello(data);
+	pid = (qint64)(((quint64)read_u32(data.constData() + 8) << 32) | read_u32(data.constData() + 12));
+	return ret;
+}
+
+QByteArray make_frame(FrameType type, const QByteArray &body){
+	QByteArray ret;
+	ret.reserve(command_frame_header_size + body.size());
+	append_u32(ret, (quint32)body.size() + 1);
+	ret.append((char)type);
+	ret.append(body);
+	return ret;
+}
+
+QByteArray make_command_frame(const QStringList &command){
+	QByteArray body;
+	QDataStream stream(&body, QIODevice::WriteOnly);
+	stream << command;
+	return make_frame(FrameType::Command, body);
+}
+
+QByteArray make_reply_frame(const CommandReply &reply){
+	QByteArray body;
+	QDataStream stream(&body, QIODevice::WriteOnly);
+	stream << reply.sequence << reply.result.success << reply.result.message;
+	return make_frame(FrameType::Reply, body);
+}
+
+QByteArray make_batch_frame(const std::vector<QStringList> &commands){
+	QByteArray body;
+	QDataStream stream(&body, QIODevice::WriteOnly);
+	stream << (quint32)commands.size();
+	for (auto &command : commands)
+		stream << command;
+	return make_frame(FrameType::Batch, body);
+}
+
+QByteArray make_batch_reply_frame(const CommandReply &reply){
+	QByteArray body;
+	QDataStream stream(&body, QIODevice::WriteOnly);
+	stream << reply.sequence << (quint32)reply.batch_results.size();
+	for (auto &result : reply.batch_results)
+		stream << result.success << result.message;
+	return make_frame(FrameType::BatchReply, body);
+}
+
+CommandResult summarize_batch(const std::vector<CommandResult> &results){
+	CommandResult ret;
+	for (size_t i = 0; i < results.size(); i++){
+		if (results[i].success)
+			continue;
+		ret.success = false;
+		if (!ret.message.isEmpty())
+			ret.message += "; ";
+		ret.message += QString("%1: %2").arg(i).arg(results[i].message);
+	}
+	return ret;
+}
+
+QByteArray make_binary_reply_frame(const CommandReply &reply){
+	QByteArray body;
+	append_u32(body, reply.sequence);
+	body.append((char)reply.result.success);
+	if (!reply.result.success)
+		body.append(reply.result.message.toUtf8());
+	return make_frame(FrameType::BinaryReply, body);
+}
+
+QByteArray make_open_ring_frame(quint32 capacity){
+	QByteArray body;
+	append_u32(body, capacity);
+	return make_frame(FrameType::OpenRing, body);
+}
+
+bool parse_open_ring_body(quint32 &capacity, const QByteArray &body){
+	if (body.size() != 4)
+		return false;
+	capacity = read_u32(body.constData());
+	return true;
+}
+
+QByteArray make_subscribe_frame(quint32 mask, const QString &target){
+	QByteArray body;
+	QDataStream stream(&body, QIODevice::WriteOnly);
+	stream << mask << target;
+	return make_frame(FrameType::Subscribe, body);
+}
+
+bool parse_subscribe_body(quint32 &mask, QString &target, const QByteArray &body){
+	QDataStream stream(body);
+	stream >> mask >> target;
+	return stream.status() == QDataStream::Ok;
+}
+
+QByteArray make_event_frame(const CommandEvent &event){
+	QByteArray body;
+	QDataStream stream(&body, QIODevice::WriteOnly);
+	stream << (quint8)event.type << event.handle << event.window << event.detail;
+	return make_frame(FrameType::Event, body);
+}
+
+bool parse_event_body(CommandEvent &event, const QByteArray &body){
+	QDataStream stream(body);
+	quint8 type;
+	stream >> type >> event.handle >> event.window >> event.detail;
+	event.type = (EventType)type;
+	return stream.status() == QDataStream::Ok;
+}
+
+QByteArray make_timestamped_frame(const QByteArray &frame){
+	QByteArray ret;
+	ret.reserve(frame.size() + command_frame_header_size + 8);
+	append_u32(ret, (quint32)(frame.size() - 4) + 9);
+	ret.append((char)FrameType::Timestamped);
+	auto now = (quint64)get_timestamp();
+	append_u32(ret, (quint32)(now >> 32));
+	append_u32(ret, (quint32)now);
+	ret.append(frame.constData() + 4, frame.size() - 4);
+	return ret;
+}
+
+bool parse_timestamped_body(qint64 &sent, FrameType &type, QByteArray &body, const QByteArray &outer){
+	if (outer.size() < 9)
+		return false;
+	auto p = outer.constData();
+	sent = (qint64)(((quint64)read_u32(p) << 32) | read_u32(p + 4));
+	type = (FrameType)(quint8)p[8];
+	body = QByteArray::fromRawData(p + 9, outer.size() - 9);
+	return true;
+}
+
+qint64 get_timestamp(){
+	typedef std::chrono::steady_clock clock;
+	return std::chrono::duration_cast<std::chrono::microseconds>(clock::now().time_since_epoch()).count();
+}
+
+const char *get_opcode_name(Opcode opcode){
+	static const char * const names[] = {
+		nullptr,
+		nullptr,
+		"load",
+		"loadsheet",
+		"loadflipbook",
+		"scale",
+		"setorigin",
+		"move",
+		"rotate",
+		"animmove",
+		"animrotate",
+		"fliph",
+		"flipv",
+		"loadscript",
+	};
+	static_assert(sizeof(names) / sizeof(*names) == (size_t)Opcode::Count, "Opcode names are out of date.");
+	auto i = (size_t)opcode;
+	if (i >= (size_t)Opcode::Count)
+		return nullptr;
+	return names[i];
+}
+
+QString format_handle(quint32 handle){
+	return '#' + QString::number(handle);
+}
+
+bool parse_handle(quint32 &dst, const QString &s){
+	if (!s.startsWith('#'))
+		return false;
+	bool ok;
+	dst = s.midRef(1).toUInt(&ok);
+	if (!ok)
+		dst = 0;
+	return true;
+}
+
+QString BinaryOperand::to_QString() const{
+	QString ret;
+	switch (this->type){
+		case OperandType::Int32:
+			ret = QString::number(this->i);
+			break;
+		case OperandType::Double:
+			ret = QString::number(this->d, 'g', 17);
+			break;
+		case OperandType::String:
+			return QString::fromUtf8(this->string, this->string_size);
+		default:
+			break;
+	}
+	if (this->relative)
+		ret.prepend('@');
+	return ret;
+}
+
+QStringList BinaryCommand::to_QStringList(const QString &target_name) const{
+	QStringList ret;
+	auto name = get_opcode_name(this->opcode);
+	if (!name)
+		return ret;
+	ret << name;
+	int i = 0;
+	switch (this->opcode){
+		case Opcode::Load:
+		case Opcode::LoadSheet:
+		case Opcode::LoadFlipbook:
+			//These take the path before the name.
+			if (this->operand_count)
+				ret << this->operands[i++].to_QString();
+			break;
+		default:
+			break;
+	}
+	ret << target_name;
+	for (; i < this->operand_count; i++)
+		ret << this->operands[i].to_QString();
+	return ret;
+}
+
+bool parse_binary_command(BinaryCommand &command, const char *data, int size){
+	if (size < binary_header_size)
+		return false;
+	command.opcode = (Opcode)read_u16(data);
+	command.flags = read_u16(data + 2);
+	command.target = read_u32(data + 4);
+	command.operand_count = (uchar)data[8];
+	if (command.operand_count > BinaryCommand::max_operands)
+		return false;
+	int offset = binary_header_size;
+	for (int i = 0; i < command.operand_count; i++){
+		auto &operand = command.operands[i];
+		if (offset >= size)
+			return false;
+		auto type = (quint8)data[offset++];
+		operand.relative = !!(type & (quint8)OperandType::Relative);
+		operand.type = (OperandType)(type & ~(quint8)OperandType::Relative);
+		switch (operand.type){
+			case OperandType::Int32:
+				if (size - offset < 4)
+					return false;
+				operand.i = (qint32)read_u32(data + offset);
+				offset += 4;
+				break;
+			case OperandType::Double:
+				{
+					if (size - offset < 8)
+						return false;
+					quint64 bits = ((quint64)read_u32(data + offset) << 32) | read_u32(data + offset + 4);
+					memcpy(&operand.d, &bits, sizeof(bits));
+					offset += 8;
+				}
+				break;
+			case OperandType::String:
+				{
+					if (size - offset < 4)
+						return false;
+					auto length = read_u32(data + offset);
+					offset += 4;
+					if ((quint32)(size - offset) < length)
+						return false;
+					operand.string = data + offset;
+					operand.string_size = (int)length;
+					offset += (int)length;
+				}
+				break;
+			default:
+				return false;
+		}
+	}
+	command.execute_at = 0;
+	if (command.flags & (quint16)CommandFlags::Scheduled){
+		if (size - offset < 8)
+			return false;
+		command.execute_at = (qint64)(((quint64)read_u32(data + offset) << 32) | read_u32(data + offset + 4));
+		offset += 8;
+	}
+	return offset == size;
+}
+
+BinaryCommandWriter::BinaryCommandWriter(Opcode opcode, quint32 target, quint16 flags){
+	//Frame header, filled in by get_frame().
+	this->frame.append(QByteArray(4, 0));
+	this->frame.append((char)FrameType::Binary);
+	append_u16(this->frame, (quint16)opcode);
+	append_u16(this->frame, flags);
+	append_u32(this->frame, target);
+	this->count_offset = this->frame.size();
+	this->frame.append((char)0);
+}
+
+BinaryCommandWriter &BinaryCommandWriter::add_int(qint32 x, bool relative){
+	this->frame.append((char)((quint8)OperandType::Int32 | (relative ? (quint8)OperandType::Relative : 0)));
+	append_u32(this->frame, (quint32)x);
+	this->frame[this->count_offset] = this->frame[this->count_offset] + 1;
+	return *this;
+}
+
+BinaryCommandWriter &BinaryCommandWriter::add_double(double x, bool relative){
+	quint64 bits;
+	memcpy(&bits, &x, sizeof(bits));
+	this->frame.append((char)((quint8)OperandType::Double | (relative ? (quint8)OperandType::Relative : 0)));
+	append_u32(this->frame, (quint32)(bits >> 32));
+	append_u32(this->frame, (quint32)bits);
+	this->frame[this->count_offset] = this->frame[this->count_offset] + 1;
+	return *this;
+}
+
+BinaryCommandWriter &BinaryCommandWriter::add_string(const QString &s){
+	auto utf8 = s.toUtf8();
+	this->frame.append((char)OperandType::String);
+	append_u32(this->frame, (quint32)utf8.size());
+	this->frame.append(utf8);
+	this->frame[this->count_offset] = this->frame[this->count_offset] + 1;
+	return *this;
+}
+
+BinaryCommandWriter &BinaryCommandWriter::set_execute_at(qint64 time){
+	const int flags_offset = command_frame_header_size + 2;
+	quint16 flags = read_u16(this->frame.constData() + flags_offset);
+	flags |= (quint16)CommandFlags::Scheduled;
+	qToBigEndian(flags, (uchar *)this->frame.data() + flags_offset);
+	append_u32(this->frame, (quint32)((quint64)time >> 32));
+	append_u32(this->frame, (quint32)time);
+	return *this;
+}
+
+const QByteArray &BinaryCommandWriter::get_frame(){
+	write_u32(this->frame, 0, (quint32)this->frame.size() - 4);
+	return this->frame;
+}
+
+void FrameReader::append(const QByteArray &data){
+	//Compact the buffer only once the consumed part dominates it.
+	if (this->offset && this->offset * 2 >= this->buffer.size()){
+		this->buffer.remove(0, this->offset);
+		this->offset = 0;
+	}
+	this->buffer.append(data);
+}
+
+bool FrameReader::next(FrameType &type, QByteArray &body){
+	if (this->error)
+		return false;
+	auto available = this->buffer.size() - this->offset;
+	if (available < 4)
+		return false;
+	auto p = this->buffer.constData() + this->offset;
+	auto length = read_u32(p);
+	if (!length || length > command_max_frame_size){
+		this->error = true;
+		return false;
+	}
+	if ((quint32)available - 4 < length)
+		return false;
+	type = (FrameType)(quint8)p[4];
+	body = QByteArray::fromRawData(p + command_frame_header_size, (int)length - 1);
+	this->offset += 4 + (int)length;
+	return true;
+}
+
+int get_legacy_message_size(const QByteArray &data){
+	//Far more than any command line could contain.
+	const quint32 max_strings = 1 << 16;
+	const quint32 null_string = 0xFFFFFFFF;
+	auto size = data.size();
+	auto p = data.constData();
+	if (size < 4)
+		return 0;
+	auto count = read_u32(p);
+	if (count > max_strings)
+		return -1;
+	int offset = 4;
+	for (quint32 i = 0; i < count; i++){
+		if (size - offset < 4)
+			return 0;
+		auto length = read_u32(p + offset);
+		offset += 4;
+		if (length == null_string)
+			continue;
+		if (length % 2 || length > command_max_frame_size)
+			return -1;
+		if ((quint32)(size - offset) < length)
+			return 0;
+		offset += (int)length;
+	}
+	return offset;
+}
+
+QStringList parse_command_body(const QByteArray &body){
+	QStringList ret;
+	QDataStream stream(body);
+	stream >> ret;
+	if (stream.status() != QDataStream::Ok)
+		ret.clear();
+	return ret;
+}
+
+bool parse_reply_body(CommandReply &reply, const QByteArray &body){
+	QDataStream stream(body);
+	stream >> reply.sequence >> reply.result.success >> reply.result.message;
+	reply.batch_results.clear();
+	return stream.status() == QDataStream::Ok;
+}
+
+bool parse_binary_reply_body(CommandReply &reply, const QByteArray &body){
+	if (body.size() < 5)
+		return false;
+	reply.sequence = read_u32(body.constData());
+	reply.result.success = !!body[4];
+	reply.result.message = reply.result.success ? QString() : QString::fromUtf8(body.constData() + 5, body.size() - 5);
+	reply.batch_results.clear();
+	return true;
+}
+
+bool parse_batch_body(std::vector<QStringList> &commands, const QByteArray &body){
+	QDataStream stream(body);
+	quint32 count;
+	stream >> count;
+	//Every command takes at least four bytes.
+	if (stream.status() != QDataStream::Ok || count > (quint32)body.size() / 4)
+		return false;
+	commands.resize(count);
+	for (auto &command : commands){
+		stream >> command;
+		if (command.isEmpty())
+			return false;
+	}
+	return stream.status() == QDataStream::Ok;
+}
+
+bool parse_batch_reply_body(CommandReply &reply, const QByteArray &body){
+	QDataStream stream(body);
+	quint32 count;
+	stream >> reply.sequence >> count;
+	if (stream.status() != QDataStream::Ok || count > (quint32)body.size())
+		return false;
+	reply.batch_results.resize(count);
+	for (auto &result : reply.batch_results)
+		stream >> result.success >> result.message;
+	reply.result = summarize_batch(reply.batch_results);
+	return stream.status() == QDataStream::Ok;
+}
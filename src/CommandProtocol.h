@@ -0,0 +1,310 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef COMMANDPROTOCOL_H
+#define COMMANDPROTOCOL_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <vector>
+
+//Persistent command connections.
+//
+//A client that sends a single command just writes the serialized QStringList
+//and waits for the server's PID, as it always has (see
+//get_legacy_message_size()). A client that wants to
+//send many commands over one socket starts by sending a hello (the magic
+//followed by the highest protocol version it understands, as a big endian
+//32-bit integer). The server answers with the magic, the version that will
+//be used and its PID. After that, both sides exchange frames:
+//
+//    [32-bit big endian length][8-bit frame type][body]
+//
+//where the length counts the type byte and the body. The client may send
+//any number of command frames without waiting; the server answers every one
+//of them with a reply frame, in order.
+//
+//Version 2 adds binary commands, which carry typed operands instead of
+//strings (see BinaryCommand). Connections that negotiate version 1 can only
+//send string commands.
+//
+//Besides replies, the server may send event frames to clients that
+//subscribed to them.
+
+static const char command_protocol_magic[] = { 'B', 'L', 'A', 'C' };
+static const quint32 command_protocol_version = 2;
+static const quint32 command_binary_protocol_version = 2;
+static const int command_hello_size = 8;
+static const int command_server_hello_size = 16;
+static const int command_frame_header_size = 5;
+//Larger frames are treated as a protocol error.
+static const quint32 command_max_frame_size = 16 << 20;
+
+enum class FrameType : quint8{
+	//Body: QStringList, starting with the command name.
+	Command = 1,
+	//Body: quint32 sequence, bool success, QString message.
+	Reply = 2,
+	//Body: QList<QStringList>. The commands are executed in order, and
+	//their effects become visible together.
+	Batch = 3,
+	//Body: quint32 sequence, quint32 count, then bool success and QString
+	//message for each command in the batch.
+	BatchReply = 4,
+	//Body: see BinaryCommand.
+	Binary = 5,
+	//Body: quint32 sequence, quint8 success, then the error message as
+	//UTF-8 if the command failed.
+	BinaryReply = 6,
+	//Body: quint32 requested capacity. Asks the server to create a
+	//CommandRing for this connection. The reply's message is the ring's
+	//shared memory key.
+	OpenRing = 7,
+	//Empty body, and no reply. Tells the server that commands were pushed
+	//into the ring while it was empty.
+	Doorbell = 8,
+	//Body: quint32 event mask, QString target. Sets which events the
+	//connection receives for the target, which is a window name, a handle
+	//("#<handle>") or empty for every window. A mask of 0 removes the
+	//subscription. Replied to with a Reply frame.
+	Subscribe = 9,
+	//Server to client only, with no sequence number. Body: quint8 event
+	//type, quint32 window handle, QString window name, QString detail.
+	//Events may arrive at any point between replies.
+	Event = 10,
+	//Body: 64-bit big endian send time (see get_timestamp()), then the
+	//type and body of another frame. The inner frame is processed as
+	//usual, and the send time is used for latency statistics.
+	Timestamped = 11,
+};
+
+//Things the server can notify subscribed clients about.
+enum class EventType : quint8{
+	//A move animation reached its destination. Not sent for animations that
+	//were cancelled or replaced.
+	AnimationComplete = 1,
+	ScriptFinished,
+	//The detail is the path.
+	LoadFinished,
+	//The handle is 0 and the detail is the path.
+	LoadFailed,
+	Count,
+};
+
+inline quint32 get_event_bit(EventType type){
+	return (quint32)1 << (int)type;
+}
+
+static const quint32 all_events = ((quint32)1 << (int)EventType::Count) - 2;
+
+struct CommandEvent{
+	EventType type;
+	quint32 handle = 0;
+	QString window;
+	QString detail;
+};
+
+//Operations that can be sent as binary commands. Except for Bind, each one
+//does the same thing as the string command of the same name, with the
+//target taking the place of the window name.
+enum class Opcode : quint16{
+	//Associates the target id with the window name given as the only
+	//operand, for the rest of the connection.
+	Bind = 1,
+	Load,
+	LoadSheet,
+	LoadFlipbook,
+	Scale,
+	SetOrigin,
+	Move,
+	Rotate,
+	AnimMove,
+	AnimRotate,
+	FlipH,
+	FlipV,
+	LoadScript,
+	Count,
+};
+
+//Returns the name of the equivalent string command, or nullptr.
+const char *get_opcode_name(Opcode);
+
+enum class CommandFlags : quint16{
+	//The target is a window handle, as returned by the load commands,
+	//rather than an id bound with Opcode::Bind.
+	TargetIsHandle = 1,
+	//The operands are followed by a 64-bit execute-at time (see
+	//BinaryCommand::execute_at).
+	Scheduled = 2,
+};
+
+//The load commands reply with the new window's handle. String commands may
+//refer to a window by handle instead of by name, written as '#' followed by
+//the handle in decimal.
+QString format_handle(quint32);
+//Returns false if the string isn't in handle form. If it is but the number
+//is malformed, the handle is set to 0, which is never valid.
+bool parse_handle(quint32 &, const QString &);
+
+enum class OperandType : quint8{
+	Int32 = 1,
+	Double = 2,
+	//32-bit length followed by UTF-8 data.
+	String = 3,
+	//Flag. The value is relative to the current one, like the '@' prefix in
+	//string commands.
+	Relative = 0x80,
+};
+
+struct BinaryOperand{
+	OperandType type;
+	bool relative;
+	union{
+		qint32 i;
+		double d;
+	};
+	//For strings. Points into the frame.
+	const char *string;
+	int string_size;
+
+	bool is_number() const{
+		return this->type == OperandType::Int32 || this->type == OperandType::Double;
+	}
+	qint32 to_int() const{
+		return this->type == OperandType::Double ? (qint32)this->d : this->i;
+	}
+	double to_double() const{
+		return this->type == OperandType::Double ? this->d : this->i;
+	}
+	QString to_QString() const;
+};
+
+//Binary command body, all big endian:
+//
+//    [16-bit opcode][16-bit flags][32-bit target][8-bit operand count]
+//    then for each operand: [8-bit type] and a 32-bit integer, a 64-bit
+//    IEEE double or a string
+//    then, if CommandFlags::Scheduled is set, the 64-bit execute-at time.
+//
+//Target ids are chosen by the client and bound to names with Opcode::Bind,
+//unless CommandFlags::TargetIsHandle is set.
+//Parsing doesn't allocate; strings point into the frame they came from.
+struct BinaryCommand{
+	static const int max_operands = 8;
+
+	Opcode opcode;
+	quint16 flags;
+	quint32 target;
+	int operand_count;
+	BinaryOperand operands[max_operands];
+	//Server clock time at which the command should run, in microseconds
+	//(see the clock command). Only meaningful if CommandFlags::Scheduled is
+	//set.
+	qint64 execute_at;
+
+	//Converts to the equivalent string command, without the leading
+	//program name. For the load commands, the target name goes after the
+	//path, as in the string commands.
+	QStringList to_QStringList(const QString &target_name) const;
+};
+
+bool parse_binary_command(BinaryCommand &, const char *data, int size);
+
+class BinaryCommandWriter{
+	QByteArray frame;
+	int count_offset;
+public:
+	BinaryCommandWriter(Opcode, quint32 target, quint16 flags = 0);
+	BinaryCommandWriter &add_int(qint32, bool relative = false);
+	BinaryCommandWriter &add_double(double, bool relative = false);
+	BinaryCommandWriter &add_string(const QString &);
+	//Sets CommandFlags::Scheduled. Must be called after every operand has
+	//been added.
+	BinaryCommandWriter &set_execute_at(qint64 time);
+	//Returns the complete frame, ready to be written.
+	const QByteArray &get_frame();
+};
+
+struct CommandResult{
+	bool success = true;
+	QString message;
+
+	CommandResult(){}
+	CommandResult(bool success, const QString &message = QString()): success(success), message(message){}
+};
+
+struct CommandReply{
+	//Position of the command in the connection's stream, counting from 0.
+	//A batch counts as a single command.
+	quint32 sequence = 0;
+	//For batches, whether every command succeeded.
+	CommandResult result;
+	//Only filled for batches.
+	std::vector<CommandResult> batch_results;
+};
+
+bool starts_with_command_magic(const QByteArray &);
+QByteArray make_client_hello(quint32 version = command_protocol_version);
+QByteArray make_server_hello(quint32 version, qint64 pid);
+//Both return 0 if the data is not a valid hello.
+quint32 parse_client_hello(const QByteArray &);
+quint32 parse_server_hello(const QByteArray &, qint64 &pid);
+
+QByteArray make_frame(FrameType, const QByteArray &body);
+QByteArray make_command_frame(const QStringList &command);
+QByteArray make_reply_frame(const CommandReply &);
+QByteArray make_batch_frame(const std::vector<QStringList> &commands);
+QByteArray make_batch_reply_frame(const CommandReply &);
+QByteArray make_binary_reply_frame(const CommandReply &);
+QByteArray make_open_ring_frame(quint32 capacity);
+bool parse_open_ring_body(quint32 &capacity, const QByteArray &);
+QByteArray make_subscribe_frame(quint32 mask, const QString &target);
+bool parse_subscribe_body(quint32 &mask, QString &target, const QByteArray &);
+QByteArray make_event_frame(const CommandEvent &);
+bool parse_event_body(CommandEvent &, const QByteArray &);
+//Wraps a complete frame in a Timestamped frame, stamped with the current
+//time.
+QByteArray make_timestamped_frame(const QByteArray &frame);
+//The inner body points into the outer one.
+bool parse_timestamped_body(qint64 &sent, FrameType &type, QByteArray &body, const QByteArray &);
+//Microseconds on a monotonic clock that is shared by every process on the
+//machine. Only used to measure latencies.
+qint64 get_timestamp();
+//Combines the results of a batch into one.
+CommandResult summarize_batch(const std::vector<CommandResult> &);
+
+class FrameReader{
+	QByteArray buffer;
+	int offset = 0;
+	bool error = false;
+public:
+	void append(const QByteArray &data);
+	//Returns false if no complete frame is available yet. The body points
+	//into the internal buffer and remains valid until the next append().
+	bool next(FrameType &type, QByteArray &body);
+	//Set if the peer sent a frame that is too large.
+	bool has_error() const{
+		return this->error;
+	}
+	bool empty() const{
+		return this->offset == this->buffer.size();
+	}
+};
+
+//Single-command clients send a QStringList serialized by QDataStream with no
+//other framing. Returns the size of the message if data contains all of it,
+//0 if more data is needed, and -1 if data can't be the start of one.
+int get_legacy_message_size(const QByteArray &data);
+
+QStringList parse_command_body(const QByteArray &);
+bool parse_reply_body(CommandReply &, const QByteArray &);
+bool parse_batch_body(std::vector<QStringList> &, const QByteArray &);
+bool parse_batch_reply_body(CommandReply &, const QByteArray &);
+bool parse_binary_reply_body(CommandReply &, const QByteArray &);
+
+#endif // COMMANDPROTOCOL_H
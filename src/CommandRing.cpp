@@ -0,0 +1,180 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "CommandRing.h"
+#include <cstring>
+#include <new>
+#include <algorithm>
+
+static_assert(sizeof(std::atomic<quint64>) == sizeof(quint64), "64-bit atomics must not need a lock.");
+
+//Lives at the start of the segment. The indices only ever grow; the slot
+//for index i is i & mask. Each index is written by one side only, and kept
+//on its own cache line.
+struct CommandRing::Header{
+	static const quint32 magic_value = 0x424C4152;
+
+	quint32 magic;
+	quint32 capacity;
+	quint32 record_size;
+	alignas(64) std::atomic<quint64> head;
+	alignas(64) std::atomic<quint64> tail;
+	alignas(64) std::atomic<quint64> dropped;
+};
+
+RingCommand::RingCommand(Opcode opcode, quint32 target, quint16 flags){
+	memset(this, 0, sizeof(*this));
+	this->opcode = (quint16)opcode;
+	this->flags = flags;
+	this->target = target;
+}
+
+RingCommand &RingCommand::add_int(qint32 x, bool relative){
+	if (this->operand_count >= max_operands)
+		return *this;
+	auto bit = 1 << this->operand_count;
+	if (relative)
+		this->relative_mask |= bit;
+	this->operands[this->operand_count++].i = x;
+	return *this;
+}
+
+RingCommand &RingCommand::add_double(double x, bool relative){
+	if (this->operand_count >= max_operands)
+		return *this;
+	auto bit = 1 << this->operand_count;
+	this->double_mask |= bit;
+	if (relative)
+		this->relative_mask |= bit;
+	this->operands[this->operand_count++].d = x;
+	return *this;
+}
+
+RingCommand &RingCommand::set_execute_at(qint64 time){
+	this->flags |= (quint16)CommandFlags::Scheduled;
+	this->execute_at = time;
+	return *this;
+}
+
+void RingCommand::to_binary(BinaryCommand &dst) const{
+	dst.opcode = (Opcode)this->opcode;
+	dst.flags = this->flags;
+	dst.target = this->target;
+	dst.execute_at = this->execute_at;
+	dst.operand_count = std::min<int>(this->operand_count, max_operands);
+	for (int i = 0; i < dst.operand_count; i++){
+		auto &operand = dst.operands[i];
+		auto bit = 1 << i;
+		operand.relative = !!(this->relative_mask & bit);
+		if (this->double_mask & bit){
+			operand.type = OperandType::Double;
+			operand.d = this->operands[i].d;
+		}else{
+			operand.type = OperandType::Int32;
+			operand.i = this->operands[i].i;
+		}
+		operand.string = nullptr;
+		operand.string_size = 0;
+	}
+}
+
+CommandRing::CommandRing(){}
+
+CommandRing::~CommandRing(){}
+
+bool CommandRing::map(bool initialize, quint32 capacity){
+	auto data = (char *)this->memory->data();
+	if (initialize){
+		this->header = new (data) Header;
+		this->header->magic = Header::magic_value;
+		this->header->capacity = capacity;
+		this->header->record_size = sizeof(RingCommand);
+		this->header->head = 0;
+		this->header->tail = 0;
+		this->header->dropped = 0;
+	}else{
+		if (this->memory->size() < (int)sizeof(Header))
+			return false;
+		this->header = (Header *)data;
+		capacity = this->header->capacity;
+		if (this->header->magic != Header::magic_value || this->header->record_size != sizeof(RingCommand))
+			return false;
+		if (!capacity || capacity > max_capacity || (capacity & (capacity - 1)))
+			return false;
+		if ((qint64)this->memory->size() < (qint64)sizeof(Header) + (qint64)capacity * sizeof(RingCommand))
+			return false;
+	}
+	if (!this->header->head.is_lock_free())
+		return false;
+	this->records = (RingCommand *)(data + sizeof(Header));
+	this->mask = capacity - 1;
+	return true;
+}
+
+bool CommandRing::create(const QString &key, quint32 capacity){
+	capacity = std::max<quint32>(std::min(capacity, max_capacity), 1);
+	quint32 rounded = 1;
+	while (rounded < capacity)
+		rounded *= 2;
+	this->memory = std::make_unique<QSharedMemory>(key);
+	if (!this->memory->create((int)(sizeof(Header) + rounded * sizeof(RingCommand)))){
+		this->memory.reset();
+		return false;
+	}
+	return this->map(true, rounded);
+}
+
+bool CommandRing::attach(const QString &key){
+	this->memory = std::make_unique<QSharedMemory>(key);
+	if (!this->memory->attach()){
+		this->memory.reset();
+		return false;
+	}
+	if (!this->map(false, 0)){
+		this->memory.reset();
+		this->header = nullptr;
+		return false;
+	}
+	return true;
+}
+
+QString CommandRing::get_key() const{
+	return this->memory ? this->memory->key() : QString();
+}
+
+bool CommandRing::push(const RingCommand &command, bool *was_empty){
+	auto head = this->header->head.load(std::memory_order_relaxed);
+	auto tail = this->header->tail.load(std::memory_order_acquire);
+	if (head - tail > this->mask){
+		this->header->dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	this->records[head & this->mask] = command;
+	this->header->head.store(head + 1, std::memory_order_release);
+	if (was_empty)
+		*was_empty = head == tail;
+	return true;
+}
+
+bool CommandRing::pop(RingCommand &command){
+	auto tail = this->header->tail.load(std::memory_order_relaxed);
+	auto head = this->header->head.load(std::memory_order_acquire);
+	if (tail == head)
+		return false;
+	//The producer owns head, so it can't be trusted to be sane.
+	if (head - tail > (quint64)this->mask + 1){
+		this->corrupt = true;
+		return false;
+	}
+	command = this->records[tail & this->mask];
+	this->header->tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+quint64 CommandRing::get_dropped() const{
+	return this->header ? this->header->dropped.load(std::memory_order_relaxed) : 0;
+}
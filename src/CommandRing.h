@@ -0,0 +1,93 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef COMMANDRING_H
+#define COMMANDRING_H
+
+#include "CommandProtocol.h"
+#include <QSharedMemory>
+#include <atomic>
+#include <memory>
+
+//Fixed-size form of a binary command, for the shared memory ring. String
+//operands aren't supported; targets must either have been bound over the
+//connection that opened the ring or be window handles.
+struct RingCommand{
+	static const int max_operands = 4;
+
+	quint16 opcode;
+	quint16 flags;
+	quint32 target;
+	quint8 operand_count;
+	//Bit i set if operand i is a double rather than an integer.
+	quint8 double_mask;
+	//Bit i set if operand i is relative.
+	quint8 relative_mask;
+	quint8 padding[5];
+	union{
+		qint32 i;
+		double d;
+	} operands[max_operands];
+	//See BinaryCommand::execute_at.
+	qint64 execute_at;
+
+	RingCommand(){}
+	RingCommand(Opcode, quint32 target, quint16 flags = 0);
+	RingCommand &add_int(qint32, bool relative = false);
+	RingCommand &add_double(double, bool relative = false);
+	//Sets CommandFlags::Scheduled.
+	RingCommand &set_execute_at(qint64 time);
+	void to_binary(BinaryCommand &) const;
+};
+
+static_assert(sizeof(RingCommand) == 56, "RingCommand must have the same layout in every process.");
+
+//Single-producer, single-consumer queue of RingCommands in a named shared
+//memory segment. The server creates it on request of a persistent
+//connection and the client attaches to it; after that, the client can push
+//commands without any system calls. If the ring is full, the command is
+//dropped and counted, rather than blocking the producer.
+class CommandRing{
+	struct Header;
+
+	std::unique_ptr<QSharedMemory> memory;
+	Header *header = nullptr;
+	RingCommand *records = nullptr;
+	quint32 mask = 0;
+	bool corrupt = false;
+
+	bool map(bool initialize, quint32 capacity);
+public:
+	static const quint32 default_capacity = 1024;
+	static const quint32 max_capacity = 1 << 20;
+
+	CommandRing();
+	~CommandRing();
+	//Capacity is rounded up to a power of two.
+	bool create(const QString &key, quint32 capacity = default_capacity);
+	bool attach(const QString &key);
+	QString get_key() const;
+
+	//Producer side. Returns false if the ring was full and the command was
+	//dropped. was_empty is set if the consumer had already caught up, in
+	//which case it may be sleeping and should be woken up.
+	bool push(const RingCommand &, bool *was_empty = nullptr);
+	//Consumer side. Returns false if the ring is empty or corrupt.
+	bool pop(RingCommand &);
+	quint32 get_capacity() const{
+		return this->mask + 1;
+	}
+	//Set by pop() if the indices in shared memory are inconsistent, which
+	//only a misbehaving producer can cause. The ring should then be closed.
+	bool is_corrupt() const{
+		return this->corrupt;
+	}
+	//Number of commands dropped because the ring was full.
+	quint64 get_dropped() const;
+};
+
+#endif // COMMANDRING_H
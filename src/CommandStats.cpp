@@ -0,0 +1,170 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "CommandStats.h"
+#include "CommandProtocol.h"
+#include <algorithm>
+
+int LatencyHistogram::get_bucket(qint64 us){
+	if (us < 16)
+		return (int)std::max<qint64>(us, 0);
+	int exponent = 4;
+	while (exponent < 39 && us >> (exponent + 1))
+		exponent++;
+	auto sub = (int)((us >> (exponent - 3)) & (sub_buckets - 1));
+	return std::min(16 + (exponent - 4) * sub_buckets + sub, bucket_count - 1);
+}
+
+//Largest value that falls in the bucket.
+qint64 LatencyHistogram::get_bucket_limit(int bucket){
+	if (bucket < 16)
+		return bucket;
+	auto exponent = 4 + (bucket - 16) / sub_buckets;
+	auto sub = (bucket - 16) % sub_buckets;
+	return ((qint64)(sub_buckets + sub + 1) << (exponent - 3)) - 1;
+}
+
+void LatencyHistogram::reset(){
+	this->buckets.fill(0);
+	this->count = 0;
+	this->max = 0;
+}
+
+void LatencyHistogram::add(qint64 us){
+	this->buckets[get_bucket(us)]++;
+	this->count++;
+	this->max = std::max(this->max, us);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other){
+	for (int i = 0; i < bucket_count; i++)
+		this->buckets[i] += other.buckets[i];
+	this->count += other.count;
+	this->max = std::max(this->max, other.max);
+}
+
+qint64 LatencyHistogram::get_percentile(double p) const{
+	if (!this->count)
+		return 0;
+	auto target = std::max<quint64>((quint64)(p * this->count + 0.5), 1);
+	quint64 accumulated = 0;
+	for (int i = 0; i < bucket_count; i++){
+		accumulated += this->buckets[i];
+		if (accumulated >= target)
+			return std::min(get_bucket_limit(i), this->max);
+	}
+	return this->max;
+}
+
+const char *CommandStats::get_stage_name(Stage stage){
+	static const char * const names[] = {
+		"transit",
+		"queue",
+		"handler",
+		"paint",
+		"total",
+	};
+	static_assert(sizeof(names) / sizeof(*names) == (size_t)Stage::Count, "Stage names are out of date.");
+	return names[(size_t)stage];
+}
+
+void CommandStats::touch(quint32 handle){
+	if (std::find(this->touched.begin(), this->touched.end(), handle) == this->touched.end())
+		this->touched.push_back(handle);
+}
+
+void CommandStats::record(const QString &type, const Timing &timing){
+	if (this->known_types.find(type) == this->known_types.end()){
+		this->unknown++;
+		return;
+	}
+	auto &stats = this->types[type];
+	auto &stages = stats.stages;
+	auto start = timing.sent ? timing.sent : timing.received;
+	if (timing.sent)
+		stages[(size_t)Stage::Transit].add(timing.received - timing.sent);
+	stages[(size_t)Stage::Queue].add(timing.dispatched - timing.received);
+	stages[(size_t)Stage::Handler].add(timing.completed - timing.dispatched);
+	this->recorded++;
+	if (this->touched.empty()){
+		stages[(size_t)Stage::Total].add(timing.completed - start);
+		return;
+	}
+	PendingPaint pending;
+	pending.stats = &stats;
+	pending.start = start;
+	pending.completed = timing.completed;
+	pending.handles = std::move(this->touched);
+	this->touched.clear();
+	this->pending.push_back(std::move(pending));
+}
+
+void CommandStats::frame_presented(quint32 handle){
+	if (this->pending.empty())
+		return;
+	auto now = get_timestamp();
+	this->expire_pending(now);
+	auto &v = this->pending;
+	v.erase(std::remove_if(v.begin(), v.end(), [handle, now](PendingPaint &pending){
+		auto &handles = pending.handles;
+		handles.erase(std::remove(handles.begin(), handles.end(), handle), handles.end());
+		if (!handles.empty())
+			return false;
+		pending.stats->stages[(size_t)Stage::Paint].add(now - pending.completed);
+		pending.stats->stages[(size_t)Stage::Total].add(now - pending.start);
+		return true;
+	}), v.end());
+}
+
+void CommandStats::expire_pending(qint64 now){
+	auto &v = this->pending;
+	v.erase(std::remove_if(v.begin(), v.end(), [now](const PendingPaint &pending){
+		if (now - pending.completed <= max_paint_wait)
+			return false;
+		pending.stats->unpainted++;
+		return true;
+	}), v.end());
+}
+
+QString CommandStats::report(){
+	this->expire_pending(get_timestamp());
+	QString ret;
+	for (auto &kv : this->types){
+		auto &stats = kv.second;
+		for (size_t i = 0; i < stats.stages.size(); i++){
+			auto &histogram = stats.stages[i];
+			if (!histogram.get_count())
+				continue;
+			ret += QString("%1 %2: n=%3 p50=%4 p99=%5 max=%6\n")
+				.arg(kv.first)
+				.arg(get_stage_name((Stage)i))
+				.arg(histogram.get_count())
+				.arg(histogram.get_percentile(0.5))
+				.arg(histogram.get_percentile(0.99))
+				.arg(histogram.get_max());
+		}
+		if (stats.unpainted)
+			ret += QString("%1 unpainted: %2\n").arg(kv.first).arg(stats.unpainted);
+	}
+	if (this->unknown)
+		ret += QString("unknown commands: %1\n").arg(this->unknown);
+	if (this->coalesced)
+		ret += QString("coalesced: %1\n").arg(this->coalesced);
+	if (this->dropped_frames)
+		ret += QString("dropped frames: %1\n").arg(this->dropped_frames);
+	return ret;
+}
+
+void CommandStats::reset(){
+	this->types.clear();
+	this->pending.clear();
+	this->touched.clear();
+	this->recorded = 0;
+	this->unknown = 0;
+	this->coalesced = 0;
+	this->dropped_frames = 0;
+}
@@ -0,0 +1,142 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef COMMANDSTATS_H
+#define COMMANDSTATS_H
+
+#include <QString>
+#include <array>
+#include <map>
+#include <set>
+#include <vector>
+
+//Fixed-size latency histogram, in microseconds. Buckets are exact below 16
+//us; above that, every power of two is split into 8 buckets, so
+//percentiles are off by at most 12.5%.
+class LatencyHistogram{
+	static const int sub_buckets = 8;
+	static const int bucket_count = 16 + 36 * sub_buckets;
+
+	std::array<quint64, bucket_count> buckets;
+	quint64 count;
+	qint64 max;
+
+	static int get_bucket(qint64);
+	static qint64 get_bucket_limit(int);
+public:
+	LatencyHistogram(){
+		this->reset();
+	}
+	void reset();
+	void add(qint64 us);
+	void merge(const LatencyHistogram &);
+	quint64 get_count() const{
+		return this->count;
+	}
+	qint64 get_max() const{
+		return this->max;
+	}
+	//p in [0, 1].
+	qint64 get_percentile(double p) const;
+};
+
+//Where commands spend their time in the server, per command type. The
+//timestamps come from get_timestamp() and are comparable between
+//processes, so they may include a client's send time.
+class CommandStats{
+public:
+	enum class Stage{
+		//Client send to server receive. Only known for commands that carry
+		//a send timestamp.
+		Transit,
+		//Receive to dispatch. Includes waiting for the commands that arrived
+		//in the same read and, for single-command clients, waiting for the
+		//client to disconnect.
+		Queue,
+		//Parsing and the handler itself.
+		Handler,
+		//Handler completion to the end of the next paint of every viewport
+		//the command changed. Skipped for commands that change none.
+		Paint,
+		//From the send time (or receive time) to the end of the paint, or
+		//to the handler's completion if there's no paint stage.
+		Total,
+		Count,
+	};
+	//Commands that cause no paint within this time are counted as
+	//unpainted rather than skewing the paint stage.
+	static const qint64 max_paint_wait = 100000;
+
+	struct Timing{
+		//0 if unknown.
+		qint64 sent = 0;
+		qint64 received = 0;
+		qint64 dispatched = 0;
+		qint64 completed = 0;
+	};
+private:
+	struct TypeStats{
+		std::array<LatencyHistogram, (size_t)Stage::Count> stages;
+		quint64 unpainted = 0;
+	};
+	struct PendingPaint{
+		TypeStats *stats;
+		qint64 start;
+		qint64 completed;
+		//Viewports that haven't painted yet.
+		std::vector<quint32> handles;
+	};
+	std::set<QString> known_types;
+	std::map<QString, TypeStats> types;
+	std::vector<PendingPaint> pending;
+	//Viewports changed by the command that is running.
+	std::vector<quint32> touched;
+	quint64 recorded = 0;
+	quint64 unknown = 0;
+	quint64 coalesced = 0;
+	quint64 dropped_frames = 0;
+
+	void expire_pending(qint64 now);
+public:
+	static const char *get_stage_name(Stage);
+	//Only known types are recorded, since the type comes from the client;
+	//the rest are just counted.
+	void add_known_type(const QString &type){
+		this->known_types.insert(type);
+	}
+	//Called before a command runs.
+	void start_command(){
+		this->touched.clear();
+	}
+	//Called when the running command changes a viewport.
+	void touch(quint32 handle);
+	//Called after the command that was started finishes.
+	void record(const QString &type, const Timing &);
+	//Called after a viewport paints.
+	void frame_presented(quint32 handle);
+	//Called when a command's change was folded into another one that was
+	//still waiting for the next frame.
+	void add_coalesced(){
+		this->coalesced++;
+	}
+	//Called when streamed animations or flipbooks couldn't show frames on
+	//time.
+	void add_dropped_frames(qint64 n){
+		this->dropped_frames += n;
+	}
+	//One line per command type and stage, with count, p50, p99 and max in
+	//microseconds, and the number of unknown and coalesced commands and
+	//dropped frames.
+	QString report();
+	void reset();
+	//Number of commands recorded since the last reset.
+	quint64 get_recorded() const{
+		return this->recorded;
+	}
+};
+
+#endif // COMMANDSTATS_H
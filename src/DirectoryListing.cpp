@@ -8,6 +8,7 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "DirectoryListing.h"
 #include "Misc.h"
 #include "ImageViewerApplication.h"
+#include "ImageFormat.h"
 #include <QDir>
 #include <QtConcurrent/QtConcurrentRun>
 #include <QImageReader>
@@ -15,21 +16,6 @@ Distributed under a permissive license. See COPYING.txt for details.
 
 const Qt::CaseSensitivity platform_case = Qt::CaseInsensitive;
 
-static const char *hardcoded_supported_extensions[] = {
-	"*.bmp",
-	"*.jpg",
-	"*.jpeg",
-	"*.png",
-	"*.gif",
-	"*.svg",
-	"*.webp",
-	"*.ico",
-	"*.tga",
-	"*.tif",
-	"*.tiff",
-	//"*.jp2", //TODO: add support
-};
-
 enum class ImageSupport{
 	Qt = 1,
 	ExternalOnly = 2,
@@ -94,7 +80,7 @@ QString ExtensionIterator::operator*() const{
 }
 
 void initialize_supported_extensions(){
-	for (auto p : hardcoded_supported_extensions)
+	for (auto &p : get_image_format_name_filters())
 		supported_extensions[p] = ImageSupport::ExternalOnly;
 #if 0
 	for (auto s : QImageReader::supportedImageFormats()){
@@ -19,6 +19,8 @@ Distributed under a permissive license. See COPYING.txt for details.
 void initialize_supported_extensions();
 
 bool check_and_clean_path(QString &path);
+//Returns the names of the supported images in the directory, sorted.
+QStringList get_local_entries(QString path);
 
 class ExtensionIterator{
 	std::unique_ptr<void, void (*)(void *)> pimpl;
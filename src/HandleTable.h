@@ -0,0 +1,82 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef HANDLETABLE_H
+#define HANDLETABLE_H
+
+#include <QtGlobal>
+#include <vector>
+
+//Dense table of objects addressed by 32-bit handles. The low 16 bits of a
+//handle are the slot index plus one and the high 16 bits are the slot's
+//generation, which is bumped every time the slot is freed. A handle that
+//outlived its object therefore doesn't match its slot anymore, and lookups
+//detect that in constant time. 0 is never a valid handle.
+template <typename T>
+class HandleTable{
+public:
+	typedef quint32 handle_t;
+	static const handle_t null_handle = 0;
+	static const size_t max_size = 0xFFFF;
+private:
+	struct Slot{
+		T value;
+		quint16 generation = 1;
+		bool used = false;
+	};
+	std::vector<Slot> slots;
+	std::vector<quint16> free_slots;
+
+	static handle_t make_handle(size_t index, quint16 generation){
+		return ((handle_t)generation << 16) | (handle_t)(index + 1);
+	}
+	Slot *get_slot(handle_t handle){
+		size_t index = handle & 0xFFFF;
+		if (!index || index > this->slots.size())
+			return nullptr;
+		auto &slot = this->slots[index - 1];
+		if (!slot.used || slot.generation != handle >> 16)
+			return nullptr;
+		return &slot;
+	}
+public:
+	//Returns null_handle if the table is full.
+	handle_t add(T &&value){
+		size_t index;
+		if (!this->free_slots.empty()){
+			index = this->free_slots.back();
+			this->free_slots.pop_back();
+		}else{
+			if (this->slots.size() >= max_size)
+				return null_handle;
+			index = this->slots.size();
+			this->slots.emplace_back();
+		}
+		auto &slot = this->slots[index];
+		slot.value = std::move(value);
+		slot.used = true;
+		return make_handle(index, slot.generation);
+	}
+	bool remove(handle_t handle){
+		auto slot = this->get_slot(handle);
+		if (!slot)
+			return false;
+		slot->value = T();
+		slot->used = false;
+		if (!++slot->generation)
+			slot->generation = 1;
+		this->free_slots.push_back((quint16)((handle & 0xFFFF) - 1));
+		return true;
+	}
+	//Returns nullptr if the handle is stale or was never valid.
+	T *get(handle_t handle){
+		auto slot = this->get_slot(handle);
+		return slot ? &slot->value : nullptr;
+	}
+};
+
+#endif // HANDLETABLE_H
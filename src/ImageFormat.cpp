@@ -0,0 +1,203 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "ImageFormat.h"
+#include <QFile>
+#include <cstring>
+
+namespace{
+
+struct FormatDescriptor{
+	ImageFormat format;
+	const char *qt_format;
+	const char *extensions[4];
+};
+
+const FormatDescriptor formats[] = {
+	{ ImageFormat::Bmp,  "bmp",  { "bmp" } },
+	{ ImageFormat::Jpeg, "jpeg", { "jpg", "jpeg" } },
+	{ ImageFormat::Png,  "png",  { "png" } },
+	{ ImageFormat::Gif,  "gif",  { "gif" } },
+	{ ImageFormat::Svg,  "svg",  { "svg" } },
+	{ ImageFormat::WebP, "webp", { "webp" } },
+	{ ImageFormat::Ico,  "ico",  { "ico" } },
+	{ ImageFormat::Tga,  "tga",  { "tga" } },
+	{ ImageFormat::Tiff, "tiff", { "tif", "tiff" } },
+	//{ ImageFormat::Jp2, "jp2", { "jp2" } }, //TODO: add support
+};
+
+const size_t header_size = 512;
+//Upper bound on the number of blocks or chunks to walk through while
+//looking for a second frame.
+const int max_scanned_blocks = 1 << 16;
+
+bool starts_with(const QByteArray &header, const char *magic, size_t n, size_t offset = 0){
+	if ((size_t)header.size() < offset + n)
+		return false;
+	return !memcmp(header.constData() + offset, magic, n);
+}
+
+quint32 read_be32(const uchar *p){
+	return ((quint32)p[0] << 24) | ((quint32)p[1] << 16) | ((quint32)p[2] << 8) | (quint32)p[3];
+}
+
+bool skip(QFile &file, qint64 n){
+	return file.seek(file.pos() + n);
+}
+
+bool skip_gif_sub_blocks(QFile &file){
+	for (int i = 0; i < max_scanned_blocks; i++){
+		char size;
+		if (!file.getChar(&size))
+			return false;
+		if (!size)
+			return true;
+		if (!skip(file, (uchar)size))
+			return false;
+	}
+	return false;
+}
+
+//Walks the GIF block structure without decoding anything, until it finds
+//either a looping extension or a second image.
+bool gif_is_animated(QFile &file){
+	if (!file.seek(10))
+		return false;
+	char packed;
+	if (!file.getChar(&packed) || !skip(file, 2))
+		return false;
+	if (packed & 0x80)
+		skip(file, 3 << ((packed & 7) + 1));
+	int frames = 0;
+	for (int i = 0; i < max_scanned_blocks; i++){
+		char c;
+		if (!file.getChar(&c))
+			return false;
+		switch ((uchar)c){
+			case 0x21:
+				{
+					char label;
+					if (!file.getChar(&label))
+						return false;
+					if ((uchar)label == 0xFF){
+						auto app = file.read(12);
+						if (app.size() == 12 && (app.mid(1) == "NETSCAPE2.0" || app.mid(1) == "ANIMEXTS1.0"))
+							return true;
+						if (app.size() < 1 || !file.seek(file.pos() - app.size() + 1 + (uchar)app[0]))
+							return false;
+					}
+					if (!skip_gif_sub_blocks(file))
+						return false;
+				}
+				break;
+			case 0x2C:
+				{
+					if (++frames > 1)
+						return true;
+					auto descriptor = file.read(9);
+					if (descriptor.size() < 9)
+						return false;
+					if (descriptor[8] & 0x80)
+						skip(file, 3 << ((descriptor[8] & 7) + 1));
+					if (!skip(file, 1) || !skip_gif_sub_blocks(file))
+						return false;
+				}
+				break;
+			default:
+				//0x3B is the trailer. Anything else is garbage.
+				return false;
+		}
+	}
+	return false;
+}
+
+//APNG requires the acTL chunk to come before the first IDAT.
+bool png_is_animated(QFile &file){
+	qint64 position = 8;
+	for (int i = 0; i < max_scanned_blocks; i++){
+		if (!file.seek(position))
+			return false;
+		auto chunk = file.read(12);
+		if (chunk.size() < 12)
+			return false;
+		auto p = (const uchar *)chunk.constData();
+		auto type = chunk.mid(4, 4);
+		if (type == "acTL")
+			return read_be32(p + 8) > 1;
+		if (type == "IDAT" || type == "IEND")
+			return false;
+		position += 12 + (qint64)read_be32(p);
+	}
+	return false;
+}
+
+ImageFormat detect_by_signature(const QByteArray &header){
+	if (starts_with(header, "\x89PNG\r\n\x1A\n", 8))
+		return ImageFormat::Png;
+	if (starts_with(header, "\xFF\xD8\xFF", 3))
+		return ImageFormat::Jpeg;
+	if (starts_with(header, "GIF87a", 6) || starts_with(header, "GIF89a", 6))
+		return ImageFormat::Gif;
+	if (starts_with(header, "RIFF", 4) && starts_with(header, "WEBP", 4, 8))
+		return ImageFormat::WebP;
+	if (starts_with(header, "BM", 2))
+		return ImageFormat::Bmp;
+	if (starts_with(header, "II*\0", 4) || starts_with(header, "MM\0*", 4))
+		return ImageFormat::Tiff;
+	if (starts_with(header, "\0\0\1\0", 4))
+		return ImageFormat::Ico;
+	if (header.indexOf("<svg") >= 0 || header.indexOf("<SVG") >= 0)
+		return ImageFormat::Svg;
+	return ImageFormat::Unknown;
+}
+
+ImageFormat detect_by_extension(const QString &path){
+	for (auto &f : formats)
+		for (auto ext : f.extensions)
+			if (ext && path.endsWith(QString(".") + ext, Qt::CaseInsensitive))
+				return f.format;
+	return ImageFormat::Unknown;
+}
+
+}
+
+QByteArray DetectedFormat::get_qt_format() const{
+	for (auto &f : formats)
+		if (f.format == this->format)
+			return f.qt_format;
+	return {};
+}
+
+DetectedFormat detect_image_format(const QString &path){
+	QFile file(path);
+	if (!file.open(QFile::ReadOnly))
+		return {};
+	auto header = file.read(header_size);
+	auto format = detect_by_signature(header);
+	switch (format){
+		case ImageFormat::Gif:
+			return DetectedFormat(format, gif_is_animated(file));
+		case ImageFormat::Png:
+			return DetectedFormat(format, png_is_animated(file));
+		case ImageFormat::WebP:
+			//The VP8X chunk, if present, carries the animation flag.
+			return DetectedFormat(format, starts_with(header, "VP8X", 4, 12) && header.size() > 20 && (header[20] & 0x02));
+		case ImageFormat::Unknown:
+			return DetectedFormat(detect_by_extension(path));
+		default:
+			return DetectedFormat(format);
+	}
+}
+
+QStringList get_image_format_name_filters(){
+	QStringList ret;
+	for (auto &f : formats)
+		for (auto ext : f.extensions)
+			if (ext)
+				ret << QString("*.") + ext;
+	return ret;
+}
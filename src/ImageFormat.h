@@ -0,0 +1,50 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef IMAGEFORMAT_H
+#define IMAGEFORMAT_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+
+enum class ImageFormat{
+	Unknown = 0,
+	Bmp,
+	Jpeg,
+	Png,
+	Gif,
+	Svg,
+	WebP,
+	Ico,
+	Tga,
+	Tiff,
+};
+
+class DetectedFormat{
+public:
+	ImageFormat format = ImageFormat::Unknown;
+	//True if the file contains more than one frame and should be played
+	//through QMovie.
+	bool animated = false;
+
+	DetectedFormat(){}
+	DetectedFormat(ImageFormat format, bool animated = false): format(format), animated(animated){}
+	//Name of the Qt image plugin that handles the format, or an empty array
+	//if the format is unknown and Qt should decide by itself.
+	QByteArray get_qt_format() const;
+};
+
+//Identifies the format by its signature, reading only the first few hundred
+//bytes of the file (plus, for GIF and PNG, the chunk headers needed to tell
+//whether there's more than one frame). Falls back to the extension for
+//formats without a signature.
+DetectedFormat detect_image_format(const QString &path);
+//Name filters ("*.png") for every format the detector knows about.
+QStringList get_image_format_name_filters();
+
+#endif // IMAGEFORMAT_H
@@ -10,6 +10,10 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "Misc.h"
 #include "GenericException.h"
 #include "Script.h"
+#include "AnimationFrames.h"
+#include "ImageViewport.h"
+#include <QFileInfo>
+#include <QDateTime>
 #include <QShortcut>
 #include <QMessageBox>
 #include <sstream>
@@ -19,37 +23,11 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include <QCryptographicHash>
 #include <random>
 #include <QJsonDocument>
-
-template <typename T>
-class AutoSetter{
-	T *dst;
-	T old_value;
-public:
-	AutoSetter(): dst(nullptr){}
-	AutoSetter(T &dst, T new_value): dst(&dst), old_value(dst){
-		*this->dst = new_value;
-	}
-	AutoSetter(const AutoSetter &) = delete;
-	AutoSetter &operator=(const AutoSetter &) = delete;
-	AutoSetter(AutoSetter &&other){
-		*this = std::move(other);
-	}
-	AutoSetter &operator=(AutoSetter &&other){
-		this->dst = other.dst;
-		other.dst = nullptr;
-		this->old_value = std::move(other.old_value);
-		return *this;
-	}
-	~AutoSetter(){
-		if (this->dst)
-			*this->dst = this->old_value;
-	}
-};
-
-template <typename T>
-AutoSetter<T> autoset(T &dst, T value){
-	return AutoSetter<T>(dst, value);
-}
+#include <QImageReader>
+#include <cmath>
+#include <algorithm>
+#include <QDebug>
+#include <QTimer>
 
 QRect get_desktop_geometry(QDesktopWidget &desktop){
 	auto n = desktop.screenCount();
@@ -67,14 +45,18 @@ QRect get_desktop_geometry(QDesktopWidget &desktop){
 	return ret;
 }
 
-ImageViewerApplication::ImageViewerApplication(int &argc, char **argv, const QString &unique_name):
+ImageViewerApplication::ImageViewerApplication(int &argc, char **argv, const QString &unique_name, bool test_mode):
 		SingleInstanceApplication(argc, argv, unique_name),
-		tray_icon(QIcon(":/icon16.png"), this){
+		tray_icon(QIcon(":/icon16.png"), this),
+		test_mode(test_mode){
 	QDir::setCurrent(this->applicationDirPath());
 	this->reset_tray_menu();
-	this->tray_icon.show();
+	if (!this->test_mode)
+		this->tray_icon.show();
 	this->setQuitOnLastWindowClosed(false);
 	this->setup_command_handlers();
+	ImageViewport::paint_listener = [this](ImageViewport &viewport){ this->get_command_stats().frame_presented(viewport.get_handle()); };
+	LoadedGraphics::dropped_frames_listener = [this](qint64 n){ this->get_command_stats().add_dropped_frames(n); };
 
 	auto desktop_geometry = get_desktop_geometry(*this->desktop());
 	
@@ -84,19 +66,165 @@ ImageViewerApplication::ImageViewerApplication(int &argc, char **argv, const QSt
 }
 
 ImageViewerApplication::~ImageViewerApplication(){
+	ImageViewport::paint_listener = nullptr;
+	LoadedGraphics::dropped_frames_listener = nullptr;
+}
+
+//"at" is recorded when the command it schedules runs, and starting or
+//stopping a recording isn't part of it.
+static bool is_recorded(const QString &command){
+	return command != "at" && command != "record";
 }
 
-void ImageViewerApplication::new_instance(const QStringList &args){
+CommandResult ImageViewerApplication::new_instance(const QStringList &args){
 	if (args.size() < 2)
-		return;
+		return CommandResult(false, "no command");
+	//Batches are recorded by new_batch(), without the commands that aren't
+	//recorded.
+	if (args[1] == "batch")
+		return this->handle_batch(args);
+	if (this->recorder.is_open() && is_recorded(args[1]))
+		this->record(args.mid(1));
+	auto depth = autoset(this->command_depth, this->command_depth + 1);
 	auto command = args[1].toStdString();
 	auto it = this->command_handlers.find(command);
 	if (it == this->command_handlers.end())
-		return;
+		return CommandResult(false, "unknown command: " + args[1]);
 	try{
-		(this->*it->second)(args);
-	}catch (ParserException &){
+		return (this->*it->second)(args);
+	}catch (ParserException &e){
+		return CommandResult(false, e.what());
+	}catch (CommandException &e){
+		return CommandResult(false, e.what());
+	}
+}
+
+std::vector<CommandResult> ImageViewerApplication::new_batch(const std::vector<QStringList> &commands){
+	if (!this->command_depth && this->recorder.is_open()){
+		//Recorded in the command line form, so that it's replayed as a
+		//single batch. The same commands are left out as outside of
+		//batches.
+		QStringList record("batch");
+		for (auto &args : commands){
+			if (args.size() >= 2 && !is_recorded(args[1]))
+				continue;
+			if (record.size() > 1)
+				record << ";";
+			for (int i = 1; i < args.size(); i++)
+				record << (args[i] == ";" ? QString(";;") : args[i]);
+		}
+		if (record.size() > 1)
+			this->record(record);
+	}
+	auto depth = autoset(this->command_depth, this->command_depth + 1);
+	ImageViewport::RepaintBatch batch;
+	std::vector<CommandResult> ret;
+	ret.reserve(commands.size());
+	for (auto &args : commands){
+		if (args.size() >= 2 && args[1] == "batch")
+			ret.push_back(CommandResult(false, "batches can't be nested"));
+		else
+			ret.push_back(this->new_instance(args));
+	}
+	this->main_window->apply_pending();
+	return ret;
+}
+
+void ImageViewerApplication::run_grouped(const std::function<void()> &f){
+	ImageViewport::RepaintBatch batch;
+	f();
+	this->main_window->apply_pending();
+}
+
+void ImageViewerApplication::record(const QStringList &command){
+	if (this->command_depth || !this->recorder.is_open())
+		return;
+	this->recorder.write(this->get_clock(), command);
+}
+
+bool ImageViewerApplication::start_recording(const QString &path){
+	if (!this->recorder.open(path, this->get_clock())){
+		qDebug() << "Can't record commands to" << path;
+		return false;
 	}
+	qDebug() << "Recording commands to" << path;
+	return true;
+}
+
+bool ImageViewerApplication::start_replay(const QString &path, double speed, QString &error){
+	std::unique_ptr<Replay> replay(new Replay);
+	if (!replay->reader.open(path, error))
+		return false;
+	replay->speed = std::max(speed, 0.0);
+	replay->start = this->get_clock();
+	replay->wall_clock.start();
+	this->replay = std::move(replay);
+	QTimer::singleShot(0, this, [this](){ this->replay_next(); });
+	return true;
+}
+
+//Commands are read one at a time and each one schedules the next, so that
+//long logs don't need to be held in memory.
+void ImageViewerApplication::replay_next(){
+	auto &replay = *this->replay;
+	qint64 time;
+	QStringList command;
+	if (!replay.reader.read(time, command)){
+		this->finish_replay();
+		return;
+	}
+	command.prepend(QString());
+	auto run = [this, command](){
+		CommandStats::Timing timing;
+		timing.received = timing.dispatched = get_timestamp();
+		this->get_command_stats().start_command();
+		auto result = this->new_instance(command);
+		timing.completed = get_timestamp();
+		this->get_command_stats().record(command.size() >= 2 ? command[1] : QString(), timing);
+		this->replay->commands++;
+		if (!result.success)
+			this->replay->failed++;
+		this->replay_next();
+	};
+	//As fast as possible still gives every command an event loop iteration
+	//of its own, so that paints and timers get to run in between like they
+	//would have originally.
+	if (!replay.speed)
+		QTimer::singleShot(0, this, run);
+	else
+		this->schedule(replay.start + (qint64)(time / replay.speed), run);
+}
+
+void ImageViewerApplication::finish_replay(){
+	auto seconds = this->replay->wall_clock.nsecsElapsed() / 1e9;
+	qDebug().noquote() << QString("Replayed %1 commands (%2 failed) in %3 s.")
+		.arg(this->replay->commands)
+		.arg(this->replay->failed)
+		.arg(seconds, 0, 'f', 3);
+	//Give the last commands a chance to be painted.
+	QTimer::singleShot((int)(CommandStats::max_paint_wait / 1000), this, [this](){
+		qDebug().noquote() << "Command latencies (us):\n" + this->get_command_stats().report();
+		this->replay.reset();
+		this->quit();
+	});
+}
+
+//Command line form of a batch: "batch move a 0 0 ; move b 10 0". A lone ";"
+//separates commands; ";;" stands for a literal ";".
+CommandResult ImageViewerApplication::handle_batch(const QStringList &args){
+	std::vector<QStringList> commands(1, QStringList(QString()));
+	for (int i = 2; i < args.size(); i++){
+		if (args[i] == ";"){
+			commands.push_back(QStringList(QString()));
+			continue;
+		}
+		commands.back() << (args[i] == ";;" ? QString(";") : args[i]);
+	}
+	commands.erase(std::remove_if(commands.begin(), commands.end(), [](const QStringList &l){ return l.size() < 2; }), commands.end());
+	auto ret = summarize_batch(this->new_batch(commands));
+	if (!ret.success)
+		qDebug() << "batch:" << ret.message;
+	return ret;
 }
 
 void ImageViewerApplication::window_closing(MainWindow *window){}
@@ -211,8 +339,40 @@ void ImageViewerApplication::reset_tray_menu(){
 	this->tray_context_menu.swap(this->last_tray_context_menu);
 }
 
-QImage ImageViewerApplication::load_image(const QString &path){
-	return QImage(path);
+QSize DecodeHint::apply(const QSize &full_size) const{
+	if (!full_size.isValid())
+		return {};
+	QSize ret;
+	if (this->size.isValid())
+		ret = full_size.scaled(this->size, Qt::KeepAspectRatio);
+	else if (this->scale > 0){
+		ret.setWidth((int)ceil(full_size.width() * this->scale));
+		ret.setHeight((int)ceil(full_size.height() * this->scale));
+	}else
+		return {};
+	ret.setWidth(std::max(ret.width(), 1));
+	ret.setHeight(std::max(ret.height(), 1));
+	if (ret.width() >= full_size.width() || ret.height() >= full_size.height())
+		return {};
+	return ret;
+}
+
+//Note: may be called from worker threads.
+QImage ImageViewerApplication::load_image(const QString &path, const QByteArray &format, const DecodeHint &hint, QSize *full_size){
+	QImageReader reader(path, format);
+	//Only relevant if the format couldn't be detected.
+	reader.setDecideFormatFromContent(format.isEmpty());
+	auto size = reader.size();
+	if (full_size)
+		*full_size = size;
+	if (hint){
+		//For JPEG this lets the decoder downscale in the DCT domain, rather
+		//than decoding everything and throwing most of it away.
+		auto target = hint.apply(size);
+		if (target.isValid())
+			reader.setScaledSize(target);
+	}
+	return reader.read();
 }
 
 QString generate_random_string(){
@@ -230,12 +390,44 @@ QString generate_random_string(){
 	return ret;
 }
 
-std::unique_ptr<QMovie> ImageViewerApplication::load_animation(const QString &path){
-	return std::make_unique<QMovie>(path);
+std::unique_ptr<QMovie> ImageViewerApplication::load_animation(const QString &path, const QByteArray &format){
+	return std::make_unique<QMovie>(path, format);
+}
+
+//Identifies a version of a file, so that the caches notice when it changes.
+static QString get_animation_key(const QString &path){
+	QFileInfo info(path);
+	return info.absoluteFilePath() + "|" + QString::number(info.lastModified().toMSecsSinceEpoch());
+}
+
+std::shared_ptr<AnimationFrames> ImageViewerApplication::get_animation_frames(const QString &path, const QByteArray &format){
+	auto key = get_animation_key(path);
+	auto it = this->animation_cache.find(key);
+	if (it != this->animation_cache.end()){
+		//Viewports drop frames that turned out to be too large, so only
+		//frames that are still decoding or fully cached are found here.
+		auto ret = it->second.lock();
+		if (ret)
+			return ret;
+	}
+	for (auto i = this->animation_cache.begin(); i != this->animation_cache.end();){
+		if (i->second.expired())
+			i = this->animation_cache.erase(i);
+		else
+			++i;
+	}
+	auto ret = AnimationFrames::create(path, format);
+	if (ret)
+		this->animation_cache[key] = ret;
+	return ret;
+}
+
+bool ImageViewerApplication::is_oversized_animation(const QString &path){
+	return this->oversized_animations.count(get_animation_key(path)) != 0;
 }
 
-bool ImageViewerApplication::is_animation(const QString &path){
-	return path.endsWith(".gif", Qt::CaseInsensitive);
+void ImageViewerApplication::set_oversized_animation(const QString &path){
+	this->oversized_animations.insert(get_animation_key(path));
 }
 
 QString get_per_user_unique_id(){
@@ -264,6 +456,9 @@ QString get_per_user_unique_id(){
 
 void ImageViewerApplication::setup_command_handlers(){
 	SETUP_COMMAND_HANDLER(load);
+	SETUP_COMMAND_HANDLER(loadsheet);
+	SETUP_COMMAND_HANDLER(loadflipbook);
+	SETUP_COMMAND_HANDLER(loadraw);
 	SETUP_COMMAND_HANDLER(scale);
 	SETUP_COMMAND_HANDLER(setorigin);
 	SETUP_COMMAND_HANDLER(move);
@@ -273,4 +468,17 @@ void ImageViewerApplication::setup_command_handlers(){
 	SETUP_COMMAND_HANDLER(fliph);
 	SETUP_COMMAND_HANDLER(flipv);
 	SETUP_COMMAND_HANDLER(loadscript);
+	SETUP_COMMAND_HANDLER(unload);
+	SETUP_COMMAND_HANDLER(group);
+	SETUP_COMMAND_HANDLER(at);
+	SETUP_COMMAND_HANDLER(clock);
+	SETUP_COMMAND_HANDLER(stats);
+	SETUP_COMMAND_HANDLER(record);
+	//Only in test mode, so that a stray command can't end a user's session.
+	if (this->test_mode)
+		SETUP_COMMAND_HANDLER(quit);
+	auto &stats = this->get_command_stats();
+	for (auto &kv : this->command_handlers)
+		stats.add_known_type(QString::fromStdString(kv.first));
+	stats.add_known_type("batch");
 }
@@ -11,19 +11,46 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "SingleInstanceApplication.h"
 #include "Settings.h"
 #include "Enums.h"
+#include "GenericException.h"
+#include "CommandLog.h"
 #include <QMenu>
 #include <memory>
 #include <exception>
 #include <QSystemTrayIcon>
 #include <QWindow>
 #include <map>
+#include <set>
 
 class QAction;
 class CustomProtocolHandler;
+class AnimationFrames;
 struct lua_State;
 
 class NoWindowsException : public std::exception{};
 
+//Thrown by command handlers. The message is returned to the client.
+class CommandException : public GenericException{
+public:
+	CommandException(const char *what): GenericException(what){}
+};
+
+//Tells the loader at what resolution an image is going to be displayed, so
+//that it doesn't need to decode it at full size. Either a scale relative to
+//the intrinsic size or a bounding size may be given.
+struct DecodeHint{
+	double scale = 0;
+	QSize size;
+
+	DecodeHint(){}
+	DecodeHint(double scale): scale(scale){}
+	DecodeHint(const QSize &size): size(size){}
+	operator bool() const{
+		return this->scale > 0 || this->size.isValid();
+	}
+	//Returns an invalid QSize if the full size should be used.
+	QSize apply(const QSize &full_size) const;
+};
+
 class ImageViewerApplication : public SingleInstanceApplication{
 	Q_OBJECT
 
@@ -42,8 +69,26 @@ class ImageViewerApplication : public SingleInstanceApplication{
 		last_tray_context_menu;
 	QByteArray last_saved_settings_digest;
 	QByteArray last_saved_state_digest;
-	typedef void (ImageViewerApplication::*command_handler_t)(const QStringList &);
+	typedef CommandResult (ImageViewerApplication::*command_handler_t)(const QStringList &);
 	std::map<std::string, command_handler_t> command_handlers;
+	std::map<QString, std::weak_ptr<AnimationFrames>> animation_cache;
+	//Animations that exceeded animation_cache_memory_cap. They are streamed
+	//right away instead of being decoded up to the cap again.
+	std::set<QString> oversized_animations;
+	bool test_mode;
+	CommandLogWriter recorder;
+	//Nesting of command dispatches, so that only the outermost command is
+	//recorded.
+	int command_depth = 0;
+	struct Replay{
+		CommandLogReader reader;
+		double speed;
+		qint64 start;
+		QElapsedTimer wall_clock;
+		quint64 commands = 0;
+		quint64 failed = 0;
+	};
+	std::unique_ptr<Replay> replay;
 
 	QString get_config_location();
 	QString get_config_subpath(QString &dst, const char *sub);
@@ -52,26 +97,55 @@ class ImageViewerApplication : public SingleInstanceApplication{
 	void setup_slots();
 	void reset_tray_menu();
 	void setup_command_handlers();
-
-	void handle_load(const QStringList &);
-	void handle_scale(const QStringList &);
-	void handle_setorigin(const QStringList &);
-	void handle_move(const QStringList &);
-	void handle_rotate(const QStringList &);
-	void handle_animmove(const QStringList &);
-	void handle_animrotate(const QStringList &);
-	void handle_fliph(const QStringList &);
-	void handle_flipv(const QStringList &);
-	void handle_loadscript(const QStringList &);
+	static std::string get_new_window_name(const QString &);
+	void record(const QStringList &command);
+	void replay_next();
+	void finish_replay();
+
+	CommandResult handle_load(const QStringList &);
+	CommandResult handle_loadsheet(const QStringList &);
+	CommandResult handle_loadflipbook(const QStringList &);
+	CommandResult handle_loadraw(const QStringList &);
+	CommandResult handle_scale(const QStringList &);
+	CommandResult handle_setorigin(const QStringList &);
+	CommandResult handle_move(const QStringList &);
+	CommandResult handle_rotate(const QStringList &);
+	CommandResult handle_animmove(const QStringList &);
+	CommandResult handle_animrotate(const QStringList &);
+	CommandResult handle_fliph(const QStringList &);
+	CommandResult handle_flipv(const QStringList &);
+	CommandResult handle_loadscript(const QStringList &);
+	CommandResult handle_unload(const QStringList &);
+	CommandResult handle_group(const QStringList &);
+	CommandResult handle_at(const QStringList &);
+	CommandResult handle_clock(const QStringList &);
+	CommandResult handle_stats(const QStringList &);
+	CommandResult handle_quit(const QStringList &);
+	CommandResult handle_record(const QStringList &);
 
 protected:
-	void new_instance(const QStringList &args) override;
+	CommandResult new_instance(const QStringList &args) override;
+	std::vector<CommandResult> new_batch(const std::vector<QStringList> &commands) override;
+	void run_grouped(const std::function<void()> &f) override;
+	CommandResult handle_batch(const QStringList &args);
+	CommandResult new_binary_instance(const BinaryCommand &, const std::string &target) override;
 	static QJsonDocument load_json(const QString &, QByteArray &digest);
 	static void conditionally_save_file(const QByteArray &contents, const QString &path, QByteArray &last_digest);
 
 public:
-	ImageViewerApplication(int &argc, char **argv, const QString &unique_name);
+	//In test mode there's no tray icon and the quit command is available.
+	ImageViewerApplication(int &argc, char **argv, const QString &unique_name, bool test_mode = false);
 	~ImageViewerApplication();
+	//Appends every command executed from now on to a command log (see
+	//CommandLog.h), with the time at which it ran. Commands scheduled with
+	//"at" are recorded when they run, also inside batches. loadraw is
+	//recorded with its shared memory key only, so replaying it fails (and
+	//is counted as failed) unless the segment exists again by then.
+	bool start_recording(const QString &path);
+	//Runs the commands in a command log, speed times as fast as they were
+	//recorded, or as fast as possible if speed is 0. Logs the statistics
+	//and quits when the log ends.
+	bool start_replay(const QString &path, double speed, QString &error);
 	bool get_clamp_to_edges() const{
 		return this->settings.get_clamp_to_edges();
 	}
@@ -95,9 +169,14 @@ public:
 	const MainSettings &get_option_values() const{
 		return this->settings;
 	}
-	QImage load_image(const QString &);
-	std::unique_ptr<QMovie> load_animation(const QString &);
-	bool is_animation(const QString &);
+	QImage load_image(const QString &, const QByteArray &format = {}, const DecodeHint & = {}, QSize *full_size = nullptr);
+	std::unique_ptr<QMovie> load_animation(const QString &, const QByteArray &format = {});
+	//Returns the frames of the animation, shared with every other viewport
+	//displaying the same file.
+	std::shared_ptr<AnimationFrames> get_animation_frames(const QString &, const QByteArray &format = {});
+	//Remembers that the file is too large to cache, until it changes.
+	bool is_oversized_animation(const QString &);
+	void set_oversized_animation(const QString &);
 
 public slots:
 	void window_closing(MainWindow *);
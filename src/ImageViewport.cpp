@@ -30,7 +30,7 @@ QMatrix translate(const QMatrix &m, const QPointF &offset){
 
 void ImageViewport::paintEvent(QPaintEvent *ev){
 	QPainter painter(this);
-	if (!this->pixmap() && !this->movie()){
+	if (!this->image || this->image->is_null()){
 		return;
 		painter.setBrush(QBrush(Qt::white));
 		auto font = painter.font();
@@ -46,15 +46,30 @@ void ImageViewport::paintEvent(QPaintEvent *ev){
 	painter.setClipping(false);
 
 	painter.setMatrix(this->get_transform());
-#if 0
-	painter.drawPixmap(QRect(QPoint(0, 0), this->image_size), static_cast<LoadedAnimation &>(*this->image).get_movie().currentPixmap());
-#else
-	if (this->pixmap())
-		painter.drawPixmap(QRect(QPoint(0, 0), this->image_size), *this->pixmap());
-	else{
-		painter.drawPixmap(QRect(QPoint(0, 0), this->image_size), this->movie()->currentPixmap());
-	}
-#endif
+	this->image->draw(painter, QRect(QPoint(0, 0), this->image_size));
+	this->painted_rect = this->get_bounding_box();
+	if (paint_listener)
+		paint_listener(*this);
+}
+
+QRect ImageViewport::get_bounding_box(){
+	if (!this->image)
+		return QRect();
+	//One extra pixel on each side for antialiasing.
+	return this->get_transform().mapRect(QRectF(this->image->get_opaque_rect())).toAlignedRect().adjusted(-1, -1, 1, 1);
+}
+
+int ImageViewport::repaint_batch_depth = 0;
+std::function<void(ImageViewport &)> ImageViewport::paint_listener;
+
+void ImageViewport::repaint_bounds(){
+	auto rect = this->get_bounding_box() | this->painted_rect;
+	if (rect.isEmpty())
+		return;
+	if (repaint_batch_depth)
+		this->update(rect);
+	else
+		this->repaint(rect);
 }
 
 void ImageViewport::set_image(std::unique_ptr<LoadedGraphics> &&li, const QSize &geom){
@@ -64,6 +79,7 @@ void ImageViewport::set_image(std::unique_ptr<LoadedGraphics> &&li, const QSize
 	auto s = this->image_size;
 	this->resize(geom);
 	this->move(0, 0);
+	this->check_timer();
 }
 
 QPoint to_QPoint(const QPointF &p){
@@ -73,16 +89,19 @@ QPoint to_QPoint(const QPointF &p){
 void ImageViewport::move_by_command(const QPointF &p){
 	this->translation = p;
 	this->update_transform = true;
-	this->repaint();
+	this->repaint_bounds();
 }
 
 void ImageViewport::set_scale(double scale){
 	this->zoom = scale;
 	this->update_transform = true;
-	this->repaint();
+	if (this->image)
+		this->image->set_display_scale(*this, scale);
+	this->repaint_bounds();
 }
 
 void ImageViewport::set_origin(int x, int y){
+	this->apply_pending();
 	QPointF new_origin(x, y);
 	auto delta = new_origin - this->origin;
 	delta = this->get_transform().map(delta) - this->translation;
@@ -94,23 +113,67 @@ void ImageViewport::set_origin(int x, int y){
 void ImageViewport::set_rotation(double theta){
 	this->rotation = theta;
 	this->update_transform = true;
-	this->repaint();
+	this->repaint_bounds();
+}
+
+bool ImageViewport::queue_move(const relabsint &x, const relabsint &y){
+	bool ret = this->pending.x.queued || this->pending.y.queued;
+	this->pending.x.queue(x.first, x.second);
+	this->pending.y.queue(y.first, y.second);
+	return ret;
+}
+
+bool ImageViewport::queue_rotation(const relabsdouble &theta){
+	bool ret = this->pending.rotation.queued;
+	this->pending.rotation.queue(theta.first, theta.second);
+	return ret;
+}
+
+bool ImageViewport::queue_scale(double scale){
+	bool ret = this->pending.scale;
+	this->pending.scale = scale;
+	return ret;
+}
+
+void ImageViewport::apply_pending(){
+	if (!this->has_pending())
+		return;
+	auto pending = std::move(this->pending);
+	this->pending = PendingState();
+	if (pending.x.queued || pending.y.queued)
+		this->translation = QPointF(pending.x.apply(this->translation.x()), pending.y.apply(this->translation.y()));
+	if (pending.rotation.queued)
+		this->rotation = pending.rotation.apply(this->rotation);
+	if (pending.scale){
+		this->zoom = *pending.scale;
+		if (this->image)
+			this->image->set_display_scale(*this, this->zoom);
+	}
+	this->update_transform = true;
+	this->repaint_bounds();
 }
 
 typedef std::chrono::high_resolution_clock T;
 
 void ImageViewport::anim_move(int x, int y, double speed, std::function<void()> &&f){
+	this->apply_pending();
 	if (!speed){
 		this->move_animator.reset();
 		this->check_timer();
 		return;
 	}
 	auto duration = norm(QPointF(x, y) - this->translation) / speed;
-	this->move_animator.reset(new MoveAnimator(*this, this->translation, QPointF(x, y), duration, std::move(f)));
+	auto on_complete = [this, f = std::move(f)](){
+		if (f)
+			f();
+		this->raise_event(EventType::AnimationComplete);
+	};
+	this->move_animator.reset(new MoveAnimator(*this, this->translation, QPointF(x, y), duration, std::move(on_complete)));
 	this->check_timer();
 }
 
 void ImageViewport::anim_rotate(double speed){
+	this->apply_pending();
 	if (!speed){
 		this->rotate_animator.reset();
 		this->check_timer();
@@ -121,7 +184,8 @@ void ImageViewport::anim_rotate(double speed){
 }
 
 void ImageViewport::check_timer(){
-	if (!this->move_animator && !this->rotate_animator && !this->script){
+	bool image_needs_ticks = this->image && this->image->needs_ticks();
+	if (!this->move_animator && !this->rotate_animator && !this->script && !image_needs_ticks){
 		if (this->timer_connection)
 			this->disconnect(this->timer_connection);
 		this->timer.reset();
@@ -164,13 +228,13 @@ bool ImageViewport::RotateAnimator::resume(){
 void ImageViewport::fliph(){
 	this->flip_h = !this->flip_h;
 	this->update_transform = true;
-	this->repaint();
+	this->repaint_bounds();
 }
 
 void ImageViewport::flipv(){
 	this->flip_v = !this->flip_v;
 	this->update_transform = true;
-	this->repaint();
+	this->repaint_bounds();
 }
 
 void ImageViewport::load_script(const QString &path){
@@ -185,12 +249,24 @@ void ImageViewport::load_script(const QString &path){
 	this->check_timer();
 }
 
+void ImageViewport::load_sprite_sheet(const QString &path, const SpriteSheetLayout &layout, double fps){
+	std::unique_ptr<LoadedGraphics> image(new LoadedSpriteSheet(path, layout, fps));
+	if (image->is_null())
+		return;
+	this->set_image(std::move(image), this->size());
+	this->update();
+}
+
 void ImageViewport::timer_timeout(){
 	if (this->move_animator && !this->move_animator->resume())
 		this->move_animator.reset();
 	if (this->rotate_animator && !this->rotate_animator->resume())
 		this->rotate_animator.reset();
-	if (this->script && !this->script->resume(*this))
+	if (this->script && !this->script->resume(*this)){
 		this->script.reset();
+		this->raise_event(EventType::ScriptFinished);
+	}
+	if (this->image && this->image->tick())
+		this->update(this->get_bounding_box());
 	this->check_timer();
 }
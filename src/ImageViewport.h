@@ -11,6 +11,8 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "Quadrangular.h"
 #include "Settings.h"
 #include "Script.h"
+#include "CommandProtocol.h"
+#include "Misc.h"
 #include <chrono>
 #include <functional>
 #include <QLabel>
@@ -19,6 +21,7 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include <QTimer>
 
 class LoadedGraphics;
+class SpriteSheetLayout;
 
 class ImageViewport : public QLabel
 {
@@ -33,8 +36,46 @@ class ImageViewport : public QLabel
 	QSize image_size;
 	bool update_transform = false;
 	QMatrix transform;
+	//Area covered by the last paint, in widget coordinates.
+	QRect painted_rect;
+	//A change to one value queued by commands. Relative changes are kept as
+	//a delta and only added to the live value when they are applied, so
+	//that animations and scripts that change it in the meantime aren't
+	//overwritten.
+	struct PendingValue{
+		Optional<double> absolute;
+		double delta = 0;
+		bool queued = false;
+
+		void queue(double value, bool relative){
+			if (relative)
+				this->delta += value;
+			else{
+				this->absolute = value;
+				this->delta = 0;
+			}
+			this->queued = true;
+		}
+		double apply(double live) const{
+			return (this->absolute ? *this->absolute : live) + this->delta;
+		}
+	};
+	//Changes queued by commands that haven't been applied yet (see
+	//queue_move()).
+	struct PendingState{
+		PendingValue x;
+		PendingValue y;
+		PendingValue rotation;
+		Optional<double> scale;
+	};
+	PendingState pending;
 	
 	std::string name;
+	quint32 handle = 0;
+public:
+	typedef std::function<void(ImageViewport &, EventType)> event_sink_t;
+private:
+	event_sink_t event_sink;
 
 	class Animator{
 	protected:
@@ -97,7 +138,33 @@ class ImageViewport : public QLabel
 		return this->transform = first * second * QMatrix().translate(this->translation.x(), this->translation.y());
 	}
 	void check_timer();
+	void raise_event(EventType type){
+		if (this->event_sink)
+			this->event_sink(*this, type);
+	}
+	static int repaint_batch_depth;
+	//Repaints the area the image covered before the last transform change
+	//plus the area it covers now.
+	void repaint_bounds();
 public:
+	//While at least one of these exists, viewports schedule their repaints
+	//instead of painting immediately, so that every change made in the
+	//meantime shows up in the same frame.
+	class RepaintBatch{
+	public:
+		RepaintBatch(){
+			ImageViewport::repaint_batch_depth++;
+		}
+		~RepaintBatch(){
+			ImageViewport::repaint_batch_depth--;
+		}
+		RepaintBatch(const RepaintBatch &) = delete;
+		RepaintBatch &operator=(const RepaintBatch &) = delete;
+	};
+
+	//Called whenever any viewport has finished painting.
+	static std::function<void(ImageViewport &)> paint_listener;
+
 	explicit ImageViewport(QWidget *parent = 0);
 	explicit ImageViewport(std::string &&name, const QSize &size, QWidget *parent = 0);
 	QSize get_image_size() const{
@@ -105,10 +172,22 @@ public:
 	}
 
 	void paintEvent(QPaintEvent *) override;
+	//Bounding box of the visible part of the image, in widget coordinates.
+	QRect get_bounding_box();
 	void set_image(std::unique_ptr<LoadedGraphics> &&li, const QSize &geom);
 	const std::string &get_name() const{
 		return this->name;
 	}
+	quint32 get_handle() const{
+		return this->handle;
+	}
+	void set_handle(quint32 handle){
+		this->handle = handle;
+	}
+	//Receives the events in EventType that concern this viewport.
+	void set_event_sink(event_sink_t &&sink){
+		this->event_sink = std::move(sink);
+	}
 
 	void move_by_command(const QPointF &);
 	void set_scale(double scale);
@@ -120,11 +199,25 @@ public:
 		return this->translation;
 	}
 	void set_rotation(double theta);
+	//Command versions of the setters above. The change is only recorded,
+	//folded with any other change to the same property that hasn't been
+	//applied yet: absolute values replace it and relative ones add to it.
+	//apply_pending() applies everything at once, adding relative changes to
+	//the values current at that time. They return true if the change was
+	//folded into a pending one.
+	bool queue_move(const relabsint &x, const relabsint &y);
+	bool queue_rotation(const relabsdouble &theta);
+	bool queue_scale(double scale);
+	bool has_pending() const{
+		return this->pending.x.queued || this->pending.y.queued || this->pending.rotation.queued || this->pending.scale;
+	}
+	void apply_pending();
 	void anim_move(int x, int y, double speed, std::function<void()> &&f = {});
 	void anim_rotate(double speed);
 	void fliph();
 	void flipv();
 	void load_script(const QString &path);
+	void load_sprite_sheet(const QString &path, const SpriteSheetLayout &, double fps);
 
 public slots:
 	void timer_timeout();
@@ -7,86 +7,186 @@ Distributed under a permissive license. See COPYING.txt for details.
 
 #include "LoadedImage.h"
 #include "DirectoryListing.h"
+#include "ColorAnalysis.h"
+#include "ImageFormat.h"
+#include "AnimationFrames.h"
+#include "AnimationStream.h"
+#include <QPainter>
+#include <QDebug>
+#include <QFile>
+#include <QImageReader>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QRegularExpression>
+#include "Script.h"
+#include <QDir>
+#include <QImageIOHandler>
+#include <QSvgRenderer>
+#include <limits>
+#include <algorithm>
 #include <QImage>
 #include <QtConcurrent/QtConcurrentRun>
 #include <QLabel>
+#include <cmath>
 
-extern const char *supported_extensions[];
+TrimmedPixmap TrimmedPixmap::create(const QImage &image){
+	TrimmedPixmap ret;
+	if (image.isNull())
+		return ret;
+	ret.size = image.size();
+	ret.rect = get_opaque_bounds(image);
+	if (ret.rect.isNull())
+		//Keep a single transparent pixel rather than a null pixmap.
+		ret.rect = QRect(0, 0, 1, 1);
+	if (ret.rect.size() == image.size())
+		ret.pixmap = QPixmap::fromImage(image);
+	else
+		ret.pixmap = QPixmap::fromImage(image.copy(ret.rect));
+	return ret;
+}
 
-LoadedImage::LoadedImage(ImageViewerApplication &app, const QString &path){
-	auto img = app.load_image(path);
-	if ((this->null = img.isNull())){
-		//Weird QImage behavior. Passing "*" allows it to load images where the
-		//file extension doesn't match the file contents.
-		img = QImage(path, "*");
-		if ((this->null = img.isNull()))
-			return;
-	}
-	this->compute_average_color(img);
-	this->image = QtConcurrent::run([](QImage img){ return QPixmap::fromImage(img); }, img);
-	this->size = img.size();
+LoadedImage::LoadedImage(ImageViewerApplication &app, const QString &path, const QByteArray &format, const DecodeHint &hint):
+		app(&app),
+		path(path),
+		format(format){
+	QSize full_size;
+	auto img = app.load_image(path, format, hint, &full_size);
+	if ((this->null = img.isNull()))
+		return;
+	this->image = QtConcurrent::run(TrimmedPixmap::create, img);
+	this->decoded_size = img.size();
+	this->size = full_size.isValid() ? full_size : img.size();
 	this->alpha = img.hasAlphaChannel();
 }
 
 LoadedImage::LoadedImage(const QImage &image){
-	this->compute_average_color(image);
-	this->image = QtConcurrent::run([](QImage img){ return QPixmap::fromImage(img); }, image);
-	this->size = image.size();
+	if ((this->null = image.isNull()))
+		return;
+	this->image = QtConcurrent::run(TrimmedPixmap::create, image);
+	this->size = this->decoded_size = image.size();
 	this->alpha = image.hasAlphaChannel();
 }
 
-LoadedImage::~LoadedImage(){
-	this->background_color.cancel();
-}
+//A redecode that is still running only holds copies of what it needs, so it
+//can be left to finish on its own.
+LoadedImage::~LoadedImage(){}
 
-QColor get_average_color(QImage src){
-	if (src.depth() < 32)
-		src = src.convertToFormat(QImage::Format_ARGB32);
-	quint64 avg[3] = {0};
-	unsigned pixel_count=0;
-	for (auto y = src.height() * 0; y < src.height(); y++){
-		const uchar *p = src.constScanLine(y);
-		for (auto x = src.width() * 0; x < src.width(); x++){
-			avg[0] += quint64(p[2]) * quint64(p[3]) / 255;
-			avg[1] += quint64(p[1]) * quint64(p[3]) / 255;
-			avg[2] += quint64(p[0]) * quint64(p[3]) / 255;
-			p += 4;
-			pixel_count++;
-		}
+QColor LoadedImage::get_background_color(){
+	if (!this->background_color){
+		if (this->null)
+			return QColor(0, 0, 0, 0);
+		this->background_color = ::get_background_color(this->get_QImage(), default_color_analysis_max_pixels);
 	}
-	for (int a = 0; a < 3; a++)
-		avg[a] /= pixel_count;
-	return QColor(avg[0], avg[1], avg[2]);
+	return *this->background_color;
 }
 
-QColor background_color_parallel_function(QImage img){
-	QColor avg = get_average_color(img),
-		negative = avg,
-		background;
-	negative.setRedF(1 - negative.redF());
-	negative.setGreenF(1 - negative.greenF());
-	negative.setBlueF(1 - negative.blueF());
-	if (negative.saturationF() <= .05 && negative.valueF() >= .45 && negative.valueF() <= .55)
-		background = Qt::white;
-	else
-		background = negative;
-	return background;
+void LoadedImage::assign_to_QLabel(QLabel &label){
+	label.setPixmap(this->image.result().pixmap);
 }
 
-void LoadedImage::compute_average_color(QImage img){
-	this->background_color = QtConcurrent::run(background_color_parallel_function, img);
+QRectF map_rect(const QRectF &rect, const QSize &from, const QRectF &to){
+	auto sx = to.width() / from.width();
+	auto sy = to.height() / from.height();
+	return QRectF(to.x() + rect.x() * sx, to.y() + rect.y() * sy, rect.width() * sx, rect.height() * sy);
 }
 
-void LoadedImage::assign_to_QLabel(QLabel &label){
-	//label.setPixmap(this->image);
+void LoadedImage::draw(QPainter &painter, const QRect &dst){
+	auto trimmed = this->image.result();
+	painter.drawPixmap(map_rect(trimmed.rect, this->decoded_size, dst), trimmed.pixmap, QRectF(trimmed.pixmap.rect()));
+}
+
+QRect LoadedImage::get_opaque_rect() const{
+	if (this->null)
+		return QRect();
+	return map_rect(this->image.result().rect, this->decoded_size, QRectF(QPoint(0, 0), this->size)).toAlignedRect();
+}
+
+bool covers(const QSize &a, const QSize &b){
+	return a.width() >= b.width() && a.height() >= b.height();
+}
+
+void LoadedImage::set_display_scale(QLabel &label, double scale){
+	if (!this->app || this->null || covers(this->decoded_size, this->size))
+		return;
+	scale = std::abs(scale);
+	QSize needed((int)ceil(this->size.width() * scale), (int)ceil(this->size.height() * scale));
+	if (covers(this->decoded_size, needed) || (this->pending_size.isValid() && covers(this->pending_size, needed)))
+		return;
+	//Decode at the next power of two of the requested scale, so that a
+	//smooth zoom doesn't trigger a re-decode on every step.
+	double bucket = 1;
+	while (bucket / 2 >= scale)
+		bucket /= 2;
+	DecodeHint hint(bucket);
+	this->pending_size = hint.apply(this->size);
+	if (!this->pending_size.isValid())
+		this->pending_size = this->size;
+
+	//A redecode that is still running is superseded rather than waited for.
+	//Replacing the watcher disconnects it, and the generation check drops
+	//any result that was already on its way.
+	auto generation = ++this->redecode_generation;
+	this->redecode = std::make_unique<QFutureWatcher<TrimmedPixmap>>();
+	auto watcher = this->redecode.get();
+	QObject::connect(watcher, &QFutureWatcher<TrimmedPixmap>::finished, [this, watcher, &label, generation](){
+		if (generation != this->redecode_generation)
+			return;
+		this->pending_size = QSize();
+		auto trimmed = watcher->result();
+		if (trimmed.size.isEmpty())
+			return;
+		//The future has finished, so reading it later never blocks.
+		this->image = watcher->future();
+		this->decoded_size = trimmed.size;
+		label.setPixmap(trimmed.pixmap);
+		label.update();
+	});
+	auto app = this->app;
+	auto path = this->path;
+	auto format = this->format;
+	//The pixmap is built on the worker too, so the GUI thread only has to
+	//swap it in.
+	watcher->setFuture(QtConcurrent::run([app, path, format, hint](){ return TrimmedPixmap::create(app->load_image(path, format, hint)); }));
 }
 
 QImage LoadedImage::get_QImage() const{
-	return ((QPixmap)this->image).toImage();
+	auto trimmed = this->image.result();
+	if (trimmed.rect.size() == this->decoded_size)
+		return trimmed.pixmap.toImage();
+	QImage ret(this->decoded_size, QImage::Format_ARGB32_Premultiplied);
+	ret.fill(Qt::transparent);
+	QPainter painter(&ret);
+	painter.drawPixmap(trimmed.rect.topLeft(), trimmed.pixmap);
+	return ret;
 }
 
-LoadedAnimation::LoadedAnimation(ImageViewerApplication &app, const QString &path){
-	this->animation = app.load_animation(path);
+LoadedAnimation::LoadedAnimation(ImageViewerApplication &app, const QString &path, const QByteArray &format):
+		app(&app),
+		path(path),
+		format(format){
+	this->t0 = std::chrono::steady_clock::now();
+	if (app.is_oversized_animation(path)){
+		QImageReader reader(path, format);
+		auto size = reader.size();
+		if (size.isValid()){
+			this->null = false;
+			this->size = size;
+			this->alpha = true;
+			this->stream = std::make_unique<AnimationStream>(path, format);
+			return;
+		}
+	}
+	this->frames = app.get_animation_frames(path, format);
+	if (this->frames){
+		this->null = false;
+		this->size = this->frames->get_size();
+		this->alpha = true;
+		if (this->frames->get_state() == AnimationFrames::State::TooLarge)
+			this->fall_back_to_stream();
+		return;
+	}
+	this->animation = app.load_animation(path, format);
 	this->null = !this->animation->isValid();
 	if (!this->null){
 		(void)this->animation->jumpToNextFrame();
@@ -95,20 +195,714 @@ LoadedAnimation::LoadedAnimation(ImageViewerApplication &app, const QString &pat
 	}
 }
 
+LoadedAnimation::~LoadedAnimation(){}
+
+qint64 LoadedAnimation::get_elapsed() const{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - this->t0).count();
+}
+
+void LoadedAnimation::fall_back_to_stream(){
+	this->app->set_oversized_animation(this->path);
+	this->frames.reset();
+	this->stream = std::make_unique<AnimationStream>(this->path, this->format);
+	//Pick up from wherever playback was.
+	auto elapsed = this->get_elapsed();
+	if (elapsed > 0)
+		this->stream->seek(elapsed);
+}
+
+void LoadedAnimation::fall_back_to_movie(){
+	this->frames.reset();
+	this->animation = this->app->load_animation(this->path, this->format);
+	if (this->label)
+		this->assign_to_QLabel(*this->label);
+}
+
 void LoadedAnimation::assign_to_QLabel(QLabel &label){
+	this->label = &label;
+	if (!this->animation)
+		return;
 	label.setMovie(this->animation.get());
 	this->animation->start();
 }
 
 QImage LoadedAnimation::get_QImage() const{
+	if (this->frames)
+		return this->frames->get_image(this->current_frame);
+	if (this->stream)
+		return this->stream->get_current_frame();
 	return this->animation->currentImage();
 }
 
-std::unique_ptr<LoadedGraphics> LoadedGraphics::create(ImageViewerApplication &app, const QString &path){
+void LoadedAnimation::draw(QPainter &painter, const QRect &dst){
+	if (this->animation){
+		painter.drawPixmap(dst, this->animation->currentPixmap());
+		return;
+	}
+	if (this->stream){
+		if (!this->stream_pixmap.isNull())
+			painter.drawPixmap(dst, this->stream_pixmap);
+		return;
+	}
+	auto pixmap = this->frames->get_pixmap(this->current_frame);
+	this->current_frame_missing = pixmap.isNull();
+	if (!this->current_frame_missing)
+		painter.drawPixmap(dst, pixmap);
+}
+
+bool LoadedAnimation::tick(){
+	if (this->stream){
+		auto dropped = this->stream->get_dropped_frames();
+		auto changed = this->stream->tick(this->get_elapsed());
+		report_dropped_frames(this->stream->get_dropped_frames() - dropped);
+		if (!changed)
+			return false;
+		this->stream_pixmap = QPixmap::fromImage(this->stream->get_current_frame());
+		return true;
+	}
+	if (!this->frames)
+		return false;
+	switch (this->frames->get_state()){
+		case AnimationFrames::State::TooLarge:
+			this->fall_back_to_stream();
+			return false;
+		case AnimationFrames::State::Failed:
+			this->fall_back_to_movie();
+			return true;
+		default:
+			break;
+	}
+	auto frame = this->frames->find_frame(this->get_elapsed());
+	//If the last paint found nothing to draw, try again in case the worker
+	//has caught up.
+	if (frame == this->current_frame && !this->current_frame_missing)
+		return false;
+	this->current_frame = frame;
+	return true;
+}
+
+qint64 LoadedAnimation::get_dropped_frames() const{
+	return this->stream ? this->stream->get_dropped_frames() : 0;
+}
+
+std::function<void(qint64)> LoadedGraphics::dropped_frames_listener;
+
+QRect parse_json_frame(const QJsonValue &value){
+	auto object = value.toObject();
+	auto frame = object.find("frame");
+	if (frame != object.end())
+		object = frame.value().toObject();
+	return QRect(object["x"].toInt(), object["y"].toInt(), object["w"].toInt(), object["h"].toInt());
+}
+
+//Compares strings with runs of digits compared by value, so that "frame2"
+//sorts before "frame10".
+static bool natural_less(const QString &a, const QString &b){
+	int i = 0,
+		j = 0;
+	while (i < a.size() && j < b.size()){
+		if (a[i].isDigit() && b[j].isDigit()){
+			int end_a = i,
+				end_b = j;
+			while (end_a < a.size() && a[end_a].isDigit())
+				end_a++;
+			while (end_b < b.size() && b[end_b].isDigit())
+				end_b++;
+			//Compare by value without converting, ignoring leading zeroes.
+			auto digits_a = a.midRef(i, end_a - i),
+				digits_b = b.midRef(j, end_b - j);
+			while (digits_a.size() > 1 && digits_a[0] == '0')
+				digits_a = digits_a.mid(1);
+			while (digits_b.size() > 1 && digits_b[0] == '0')
+				digits_b = digits_b.mid(1);
+			if (digits_a.size() != digits_b.size())
+				return digits_a.size() < digits_b.size();
+			auto c = digits_a.compare(digits_b);
+			if (c)
+				return c < 0;
+			i = end_a;
+			j = end_b;
+			continue;
+		}
+		if (a[i] != b[j])
+			return a[i] < b[j];
+		i++;
+		j++;
+	}
+	return a.size() - i < b.size() - j;
+}
+
+SpriteSheetLayout SpriteSheetLayout::parse(const QString &description){
+	SpriteSheetLayout ret;
+	//Anything that isn't a grid is the path to a description.
+	static const QRegularExpression grid("^\\d+x\\d+(x\\d+)?$", QRegularExpression::CaseInsensitiveOption);
+	if (!grid.match(description).hasMatch()){
+		QFile file(description);
+		if (!file.open(QFile::ReadOnly))
+			throw ParserException("can't open sprite sheet description " + description.toStdString());
+		auto document = QJsonDocument::fromJson(file.readAll());
+		QJsonValue frames;
+		if (document.isArray())
+			frames = document.array();
+		else if (document.isObject()){
+			auto object = document.object();
+			frames = object["frames"];
+			ret.fps = object["fps"].toDouble();
+		}
+		if (frames.isArray()){
+			for (auto frame : frames.toArray())
+				ret.frames.push_back(parse_json_frame(frame));
+		}else if (frames.isObject()){
+			//Keys are frame names. QJsonObject iterates them alphabetically,
+			//which would put "frame10" before "frame2", so they're sorted
+			//naturally instead.
+			auto object = frames.toObject();
+			auto keys = object.keys();
+			std::sort(keys.begin(), keys.end(), natural_less);
+			for (auto &key : keys)
+				ret.frames.push_back(parse_json_frame(object[key]));
+		}
+		if (!ret.frames.size())
+			throw ParserException("sprite sheet description contains no frames");
+		return ret;
+	}
+	auto parts = description.split('x', QString::KeepEmptyParts, Qt::CaseInsensitive);
+	if (parts.size() < 2 || parts.size() > 3)
+		throw ParserException("expected sprite sheet cell size but found " + description.toStdString());
+	ret.cell = QSize(expect_integer(parts[0]), expect_integer(parts[1]));
+	if (ret.cell.width() <= 0 || ret.cell.height() <= 0)
+		throw ParserException("invalid sprite sheet cell size");
+	if (parts.size() == 3)
+		ret.count = expect_integer(parts[2]);
+	return ret;
+}
+
+std::vector<QRect> SpriteSheetLayout::resolve(const QSize &sheet_size) const{
+	std::vector<QRect> ret;
+	QRect bounds(QPoint(0, 0), sheet_size);
+	if (this->cell.isValid()){
+		auto columns = sheet_size.width() / this->cell.width();
+		auto rows = sheet_size.height() / this->cell.height();
+		auto n = columns * rows;
+		if (this->count > 0)
+			n = std::min(n, this->count);
+		ret.reserve(n);
+		for (int i = 0; i < n; i++)
+			ret.emplace_back(QPoint(i % columns * this->cell.width(), i / columns * this->cell.height()), this->cell);
+		return ret;
+	}
+	for (auto &frame : this->frames){
+		auto clipped = frame & bounds;
+		if (!clipped.isEmpty())
+			ret.push_back(clipped);
+	}
+	return ret;
+}
+
+LoadedSpriteSheet::LoadedSpriteSheet(const QString &path, const SpriteSheetLayout &layout, double fps){
+	this->alpha = true;
+	QImageReader reader(path, detect_image_format(path).get_qt_format());
+	auto image = reader.read();
+	this->frames = layout.resolve(image.size());
+	if ((this->null = image.isNull() || !this->frames.size()))
+		return;
+	this->sheet = QPixmap::fromImage(image);
+	this->fps = fps > 0 ? fps : layout.get_fps();
+	this->size = this->frames.front().size();
+	this->t0 = std::chrono::steady_clock::now();
+}
+
+QImage LoadedSpriteSheet::get_QImage() const{
+	if (this->null)
+		return {};
+	return this->sheet.copy(this->frames[this->current_frame]).toImage();
+}
+
+void LoadedSpriteSheet::draw(QPainter &painter, const QRect &dst){
+	painter.drawPixmap(dst, this->sheet, this->frames[this->current_frame]);
+}
+
+bool LoadedSpriteSheet::tick(){
+	if (!this->needs_ticks())
+		return false;
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->t0).count();
+	auto frame = (size_t)(elapsed * this->fps) % this->frames.size();
+	if (frame == this->current_frame)
+		return false;
+	this->current_frame = frame;
+	return true;
+}
+
+QImage decode_flipbook_frame(const QString &path, std::shared_ptr<std::atomic<bool>> cancelled){
+	//Jobs usually get cancelled while they're still queued.
+	if (*cancelled)
+		return QImage();
+	QImageReader reader(path, detect_image_format(path).get_qt_format());
+	return reader.read().convertToFormat(QImage::Format_ARGB32_Premultiplied);
+}
+
+LoadedFlipbook::LoadedFlipbook(const QString &directory, double fps, size_t lookahead):
+		fps(fps),
+		lookahead(std::max<size_t>(lookahead, 1)),
+		last_late_frame(std::numeric_limits<size_t>::max()){
+	this->alpha = true;
+	QDir dir(directory);
+	for (auto &name : get_local_entries(directory))
+		this->files << dir.filePath(name);
+	this->null = true;
+	if (!this->files.size())
+		return;
+	//The first frame is needed right away to know the size.
+	auto first = decode_flipbook_frame(this->files[0], std::make_shared<std::atomic<bool>>(false));
+	if ((this->null = first.isNull()))
+		return;
+	this->size = first.size();
+	this->current_pixmap = QPixmap::fromImage(first);
+	this->t0 = std::chrono::steady_clock::now();
+	this->schedule(1);
+}
+
+LoadedFlipbook::~LoadedFlipbook(){
+	for (auto &kv : this->pending)
+		*kv.second.cancelled = true;
+}
+
+void LoadedFlipbook::schedule(size_t first){
+	auto n = (size_t)this->files.size();
+	if (n < 2)
+		return;
+	//Forget whatever fell out of the window.
+	for (auto i = this->pending.begin(); i != this->pending.end();){
+		if ((i->first + n - first) % n >= this->lookahead){
+			*i->second.cancelled = true;
+			i = this->pending.erase(i);
+		}else
+			++i;
+	}
+	for (size_t i = 0; i < this->lookahead; i++){
+		auto index = (first + i) % n;
+		if (this->pending.find(index) != this->pending.end())
+			continue;
+		PendingFrame frame;
+		frame.cancelled = std::make_shared<std::atomic<bool>>(false);
+		frame.image = QtConcurrent::run(decode_flipbook_frame, this->files[(int)index], frame.cancelled);
+		this->pending[index] = std::move(frame);
+	}
+}
+
+void LoadedFlipbook::draw(QPainter &painter, const QRect &dst){
+	if (!this->current_pixmap.isNull())
+		painter.drawPixmap(dst, this->current_pixmap);
+}
+
+bool LoadedFlipbook::tick(){
+	if (!this->needs_ticks())
+		return false;
+	auto n = (size_t)this->files.size();
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->t0).count();
+	auto target = (size_t)(elapsed * this->fps) % n;
+	if (target == this->current_frame)
+		return false;
+	auto it = this->pending.find(target);
+	if (it == this->pending.end() || !it->second.image.isFinished()){
+		//Keep showing the previous frame.
+		if (this->last_late_frame != target){
+			this->last_late_frame = target;
+			this->dropped_frames++;
+			report_dropped_frames(1);
+		}
+		this->schedule(target);
+		return false;
+	}
+	auto image = it->second.image.result();
+	this->pending.erase(it);
+	this->current_frame = target;
+	if (!image.isNull())
+		this->current_pixmap = QPixmap::fromImage(image);
+	this->schedule((target + 1) % n);
+	return true;
+}
+
+//Only uses its own copies, so nothing waits for it when the image goes
+//away; the result is then just dropped with the watcher.
+QImage rasterise_svg(const QByteArray &data, const QSize &size){
+	QSvgRenderer renderer(data);
+	QImage ret(size, QImage::Format_ARGB32_Premultiplied);
+	if (ret.isNull())
+		return ret;
+	ret.fill(Qt::transparent);
+	QPainter painter(&ret);
+	renderer.render(&painter);
+	return ret;
+}
+
+LoadedRawImage::LoadedRawImage(const QString &key, const QSize &size, int stride, QImage::Format format):
+		memory(new QSharedMemory(key)){
+	this->null = true;
+	this->alpha = true;
+	this->size = size;
+	if (size.isEmpty() || stride % 4 || stride < (qint64)size.width() * 4)
+		return;
+	if (!this->memory->attach(QSharedMemory::ReadOnly))
+		return;
+	auto needed = (qint64)stride * (size.height() - 1) + (qint64)size.width() * 4;
+	if (this->memory->size() < needed)
+		return;
+	//The const constructor never writes to the buffer and never copies it.
+	this->image = QImage((const uchar *)this->memory->constData(), size.width(), size.height(), stride, format);
+	if ((this->null = this->image.isNull()))
+		return;
+	this->opaque_rect = get_opaque_bounds(this->image);
+}
+
+LoadedRawImage::~LoadedRawImage(){
+	//The image must not outlive the mapping.
+	this->image = QImage();
+}
+
+QColor LoadedRawImage::get_background_color(){
+	if (!this->background_color){
+		if (this->null)
+			return QColor(0, 0, 0, 0);
+		this->background_color = ::get_background_color(this->image, default_color_analysis_max_pixels);
+	}
+	return *this->background_color;
+}
+
+void LoadedRawImage::draw(QPainter &painter, const QRect &dst){
+	painter.drawImage(dst, this->image);
+}
+
+LoadedSvg::LoadedSvg(const QString &path){
+	this->alpha = true;
+	this->null = true;
+	QFile file(path);
+	if (!file.open(QFile::ReadOnly))
+		return;
+	this->data = file.readAll();
+	QSvgRenderer renderer(this->data);
+	if (!renderer.isValid())
+		return;
+	this->size = renderer.defaultSize();
+	if (this->size.isEmpty())
+		return;
+	//Rasterise the intrinsic size right away, so that there is always
+	//something to draw.
+	auto image = rasterise_svg(this->data, this->size);
+	if (image.isNull())
+		return;
+	this->rasterisations[0] = QPixmap::fromImage(image);
+	this->null = false;
+}
+
+QColor LoadedSvg::get_background_color(){
+	if (!this->background_color)
+		this->background_color = ::get_background_color(this->get_QImage(), default_color_analysis_max_pixels);
+	return *this->background_color;
+}
+
+QImage LoadedSvg::get_QImage() const{
+	auto it = this->rasterisations.find(0);
+	if (it != this->rasterisations.end())
+		return it->second.toImage();
+	return rasterise_svg(this->data, this->size);
+}
+
+QSize LoadedSvg::get_bucket_size(int bucket) const{
+	auto scale = std::ldexp(1.0, bucket);
+	return QSize((int)ceil(this->size.width() * scale), (int)ceil(this->size.height() * scale));
+}
+
+void LoadedSvg::set_display_scale(QLabel &label, double scale){
+	if (this->null)
+		return;
+	this->label = &label;
+	scale = std::abs(scale);
+	if (scale <= 0)
+		return;
+	int bucket = (int)ceil(std::log2(scale));
+	//Don't go below the intrinsic size, and don't allocate absurdly large
+	//images when zooming in very far; past that point the largest
+	//rasterisation is scaled like a bitmap.
+	bucket = std::max(bucket, 0);
+	while (bucket > 0){
+		auto size = this->get_bucket_size(bucket);
+		if (std::max(size.width(), size.height()) <= max_rasterisation_side)
+			break;
+		bucket--;
+	}
+	this->wanted_bucket = bucket;
+	if (this->rasterisations.find(bucket) == this->rasterisations.end())
+		this->request_bucket(bucket);
+}
+
+void LoadedSvg::request_bucket(int bucket){
+	if (this->pending.find(bucket) != this->pending.end())
+		return;
+	auto watcher = new QFutureWatcher<QImage>;
+	this->pending[bucket].reset(watcher);
+	QObject::connect(watcher, &QFutureWatcher<QImage>::finished, [this, bucket](){ this->rasterisation_ready(bucket); });
+	watcher->setFuture(QtConcurrent::run(rasterise_svg, this->data, this->get_bucket_size(bucket)));
+}
+
+void LoadedSvg::rasterisation_ready(int bucket){
+	auto it = this->pending.find(bucket);
+	if (it == this->pending.end())
+		return;
+	auto image = it->second->result();
+	it->second.release()->deleteLater();
+	this->pending.erase(it);
+	if (image.isNull())
+		return;
+	this->rasterisations[bucket] = QPixmap::fromImage(image);
+	this->evict();
+	if (this->label)
+		this->label->update();
+}
+
+void LoadedSvg::evict(){
+	//Drop the rasterisations furthest from the current zoom, but always keep
+	//the intrinsic size one.
+	while (this->rasterisations.size() > (size_t)max_cached_rasterisations){
+		auto furthest = this->rasterisations.end();
+		for (auto it = this->rasterisations.begin(); it != this->rasterisations.end(); ++it){
+			if (!it->first)
+				continue;
+			if (furthest == this->rasterisations.end() || std::abs(it->first - this->wanted_bucket) > std::abs(furthest->first - this->wanted_bucket))
+				furthest = it;
+		}
+		if (furthest == this->rasterisations.end())
+			break;
+		this->rasterisations.erase(furthest);
+	}
+}
+
+void LoadedSvg::draw(QPainter &painter, const QRect &dst){
+	if (this->rasterisations.empty())
+		return;
+	//Prefer the wanted bucket, then the closest larger one, then the
+	//closest smaller one.
+	auto it = this->rasterisations.lower_bound(this->wanted_bucket);
+	if (it == this->rasterisations.end())
+		--it;
+	painter.drawPixmap(dst, it->second);
+}
+
+bool LoadedTiledImage::should_tile(const QSize &size){
+	//Some platforms can't create pixmaps larger than this on either side.
+	const int max_side = 16384;
+	const qint64 max_pixels = (qint64)1 << 26;
+	return size.width() > max_side || size.height() > max_side || (qint64)size.width() * size.height() > max_pixels;
+}
+
+//Decodes the whole image at target size, without ever holding more than
+//max_bytes of full-resolution pixels.
+QImage decode_scaled(const QString &path, const QByteArray &format, const QSize &size, const QSize &target, qint64 max_bytes){
+	QImageReader reader(path, format);
+	if (reader.supportsOption(QImageIOHandler::ScaledSize)){
+		reader.setScaledSize(target);
+		return reader.read();
+	}
+	if (reader.supportsOption(QImageIOHandler::ClipRect)){
+		//Decode horizontal bands and scale each one down separately.
+		auto rows = (int)std::max<qint64>(max_bytes / ((qint64)size.width() * 4), 1);
+		QImage ret(target, QImage::Format_ARGB32_Premultiplied);
+		ret.fill(Qt::transparent);
+		QPainter painter(&ret);
+		painter.setRenderHint(QPainter::SmoothPixmapTransform);
+		for (int y = 0; y < size.height(); y += rows){
+			auto y1 = std::min(y + rows, size.height());
+			QRect dst(0, (int)((qint64)y * target.height() / size.height()), target.width(), 0);
+			dst.setBottom((int)((qint64)y1 * target.height() / size.height()) - 1);
+			if (dst.isEmpty())
+				continue;
+			QImageReader band(path, format);
+			band.setClipRect(QRect(0, y, size.width(), y1 - y));
+			band.setScaledSize(dst.size());
+			auto image = band.read();
+			if (image.isNull())
+				return QImage();
+			painter.drawImage(dst, image);
+		}
+		return ret;
+	}
+	if ((qint64)size.width() * size.height() * 4 > max_bytes){
+		qDebug() << path << "is too large to decode without support for clipped or scaled decoding.";
+		return QImage();
+	}
+	return reader.read().scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+}
+
+QImage decode_tile(const QString &path, const QByteArray &format, const QRect &rect, const QSize &decoded_size){
+	QImageReader reader(path, format);
+	reader.setClipRect(rect);
+	if (decoded_size != rect.size())
+		reader.setScaledSize(decoded_size);
+	return reader.read();
+}
+
+quint64 make_tile_key(int level, int x, int y){
+	return ((quint64)level << 56) | ((quint64)y << 28) | (quint64)x;
+}
+
+LoadedTiledImage::LoadedTiledImage(const QString &path, const QByteArray &format, const QSize &size):
+		path(path),
+		format(format){
+	this->size = size;
+	this->alpha = true;
+	QImageReader reader(path, format);
+	if (reader.supportsOption(QImageIOHandler::ClipRect)){
+		if (reader.supportsOption(QImageIOHandler::ScaledSize)){
+			//Go down until a level is no larger than the overview.
+			this->max_level = 0;
+			while (std::max(size.width(), size.height()) >> this->max_level > overview_size)
+				this->max_level++;
+		}else{
+			//Coarser tiles would be decoded at full resolution and then
+			//scaled, so keep the clipped region small.
+			this->max_level = 2;
+		}
+	}
+	auto side = this->max_level < 0 ? fallback_size : overview_size;
+	this->overview_image = decode_scaled(path, format, size, size.scaled(side, side, Qt::KeepAspectRatio), tile_cache_budget);
+	this->null = this->overview_image.isNull();
+	this->overview = QPixmap::fromImage(this->overview_image);
+}
+
+QColor LoadedTiledImage::get_background_color(){
+	return ::get_background_color(this->overview_image);
+}
+
+QRect LoadedTiledImage::get_tile_rect(int level, int x, int y) const{
+	auto side = tile_size << level;
+	return QRect(x * side, y * side, side, side) & QRect(QPoint(0, 0), this->size);
+}
+
+void LoadedTiledImage::request_tile(tile_key_t key, const QRect &rect, const QSize &decoded_size){
+	if (this->pending.find(key) != this->pending.end())
+		return;
+	auto bytes = (qint64)decoded_size.width() * decoded_size.height() * 4;
+	if (!this->make_room(bytes))
+		return;
+	auto watcher = new QFutureWatcher<QImage>;
+	auto &pending = this->pending[key];
+	pending.watcher.reset(watcher);
+	pending.bytes = bytes;
+	this->pending_bytes += bytes;
+	QObject::connect(watcher, &QFutureWatcher<QImage>::finished, [this, key](){ this->tile_ready(key); });
+	watcher->setFuture(QtConcurrent::run(decode_tile, this->path, this->format, rect, decoded_size));
+}
+
+void LoadedTiledImage::tile_ready(tile_key_t key){
+	auto it = this->pending.find(key);
+	if (it == this->pending.end())
+		return;
+	auto image = it->second.watcher->result();
+	auto bytes = it->second.bytes;
+	//Deleting the watcher from inside its own signal isn't safe.
+	it->second.watcher.release()->deleteLater();
+	this->pending.erase(it);
+	this->pending_bytes -= bytes;
+	if (image.isNull())
+		return;
+	CachedTile tile;
+	tile.pixmap = QPixmap::fromImage(image);
+	tile.bytes = bytes;
+	this->lru.push_front(key);
+	tile.lru_position = this->lru.begin();
+	this->cached_bytes += bytes;
+	this->tiles[key] = std::move(tile);
+	if (this->label)
+		this->label->update();
+}
+
+bool LoadedTiledImage::make_room(qint64 bytes){
+	auto it = this->lru.end();
+	while (this->cached_bytes + this->pending_bytes + bytes > tile_cache_budget && it != this->lru.begin()){
+		--it;
+		auto key = *it;
+		if (this->visible.find(key) != this->visible.end())
+			continue;
+		auto tile = this->tiles.find(key);
+		this->cached_bytes -= tile->second.bytes;
+		this->tiles.erase(tile);
+		it = this->lru.erase(it);
+	}
+	return this->cached_bytes + this->pending_bytes + bytes <= tile_cache_budget;
+}
+
+void LoadedTiledImage::draw(QPainter &painter, const QRect &dst){
+	painter.drawPixmap(dst, this->overview);
+	painter.save();
+	//Work in image coordinates from here on.
+	painter.translate(dst.topLeft());
+	painter.scale((double)dst.width() / this->size.width(), (double)dst.height() / this->size.height());
+	this->draw_tiles(painter);
+	painter.restore();
+}
+
+void LoadedTiledImage::draw_tiles(QPainter &painter){
+	auto transform = painter.transform();
+	//Device pixels per image pixel. Below the overview's resolution, the
+	//tiles wouldn't add anything.
+	auto scale = std::sqrt(std::abs(transform.determinant()));
+	if (this->max_level < 0 || scale * this->size.width() <= this->overview.width())
+		return;
+	//The coarsest level that still has a pixel for every device pixel.
+	int level = 0;
+	while (level < this->max_level && scale * (2 << level) <= 1)
+		level++;
+
+	bool invertible;
+	auto inverse = transform.inverted(&invertible);
+	if (!invertible)
+		return;
+	auto visible = inverse.mapRect(QRectF(painter.viewport())).toAlignedRect() & QRect(QPoint(0, 0), this->size);
+	if (visible.isEmpty())
+		return;
+	auto side = tile_size << level;
+	//Collect every visible tile first, so that requesting one can't evict
+	//another.
+	this->visible.clear();
+	for (int y = visible.top() / side; y <= visible.bottom() / side; y++)
+		for (int x = visible.left() / side; x <= visible.right() / side; x++)
+			this->visible.insert(make_tile_key(level, x, y));
+	for (int y = visible.top() / side; y <= visible.bottom() / side; y++){
+		for (int x = visible.left() / side; x <= visible.right() / side; x++){
+			auto key = make_tile_key(level, x, y);
+			auto rect = this->get_tile_rect(level, x, y);
+			auto it = this->tiles.find(key);
+			if (it == this->tiles.end()){
+				auto round = (1 << level) - 1;
+				this->request_tile(key, rect, QSize((rect.width() + round) >> level, (rect.height() + round) >> level));
+				continue;
+			}
+			this->lru.splice(this->lru.begin(), this->lru, it->second.lru_position);
+			painter.drawPixmap(rect, it->second.pixmap);
+		}
+	}
+}
+
+std::unique_ptr<LoadedGraphics> LoadedGraphics::create(ImageViewerApplication &app, const QString &path, const DecodeHint &hint){
 	std::unique_ptr<LoadedGraphics> ret;
-	if (app.is_animation(path))
-		ret.reset(new LoadedAnimation(app, path));
+	//Sniff the file once and let that decide both the decoder and whether
+	//it's played as an animation.
+	auto format = detect_image_format(path);
+	if (format.animated){
+		ret.reset(new LoadedAnimation(app, path, format.get_qt_format()));
+		return ret;
+	}
+	if (format.format == ImageFormat::Svg){
+		ret.reset(new LoadedSvg(path));
+		return ret;
+	}
+	auto size = QImageReader(path, format.get_qt_format()).size();
+	auto decoded_size = hint ? hint.apply(size) : QSize();
+	if (!decoded_size.isValid())
+		decoded_size = size;
+	if (size.isValid() && LoadedTiledImage::should_tile(decoded_size))
+		ret.reset(new LoadedTiledImage(path, format.get_qt_format(), size));
 	else
-		ret.reset(new LoadedImage(app, path));
+		ret.reset(new LoadedImage(app, path, format.get_qt_format(), hint));
 	return ret;
 }
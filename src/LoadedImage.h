@@ -9,20 +9,43 @@ Distributed under a permissive license. See COPYING.txt for details.
 #define LOADEDIMAGE_H
 
 #include "ImageViewerApplication.h"
+#include "Misc.h"
 #include <QString>
 #include <QPixmap>
 #include <QMovie>
 #include <QFuture>
+#include <QFutureWatcher>
+#include <QSharedMemory>
 #include <memory>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
 
 class QLabel;
+class QPainter;
+class AnimationFrames;
+class AnimationStream;
 
 class LoadedGraphics{
 protected:
 	QSize size;
 	bool alpha;
 	bool null;
+
+	static void report_dropped_frames(qint64 n){
+		if (n > 0 && dropped_frames_listener)
+			dropped_frames_listener(n);
+	}
 public:
+	//Called with the number of frames that content which plays over time
+	//couldn't show on time, as they're dropped.
+	static std::function<void(qint64)> dropped_frames_listener;
+
 	virtual ~LoadedGraphics(){}
 	virtual bool is_animation() const = 0;
 	virtual QColor get_background_color() = 0;
@@ -37,33 +60,92 @@ public:
 	}
 	virtual void assign_to_QLabel(QLabel &) = 0;
 	virtual QImage get_QImage() const = 0;
-	static std::unique_ptr<LoadedGraphics> create(ImageViewerApplication &app, const QString &path);
+	//Called when the display scale changes, in case the object needs to
+	//provide more detail.
+	virtual void set_display_scale(QLabel &, double){}
+	//Draws the current frame scaled to dst.
+	virtual void draw(QPainter &, const QRect &dst) = 0;
+	//For content that changes over time. Returns true if the viewport needs
+	//to be repainted.
+	virtual bool tick(){
+		return false;
+	}
+	virtual bool needs_ticks() const{
+		return false;
+	}
+	//The part of the image that may contain visible pixels, in image
+	//coordinates. Nothing outside of it is ever drawn.
+	virtual QRect get_opaque_rect() const{
+		return QRect(QPoint(0, 0), this->size);
+	}
+	static std::unique_ptr<LoadedGraphics> create(ImageViewerApplication &app, const QString &path, const DecodeHint & = {});
+};
+
+//A decoded image with its fully transparent borders cropped off.
+struct TrimmedPixmap{
+	QPixmap pixmap;
+	//Where the pixmap goes in the decoded image.
+	QRect rect;
+	//Size of the decoded image. Empty if it couldn't be decoded.
+	QSize size;
+
+	static TrimmedPixmap create(const QImage &);
 };
 
 class LoadedImage : public LoadedGraphics{
-	QFuture<QPixmap> image;
-	QFuture<QColor> background_color;
+	ImageViewerApplication *app = nullptr;
+	QString path;
+	QByteArray format;
+	QFuture<TrimmedPixmap> image;
+	Optional<QColor> background_color;
+	//Resolution at which the image was actually decoded. May be smaller than
+	//this->size if a DecodeHint was given.
+	QSize decoded_size;
+	QSize pending_size;
+	std::unique_ptr<QFutureWatcher<TrimmedPixmap>> redecode;
+	//Bumped by every redecode, so that results of superseded ones are
+	//ignored.
+	quint64 redecode_generation = 0;
 
-	void compute_average_color(QImage);
 public:
-	LoadedImage(ImageViewerApplication &app, const QString &path);
+	LoadedImage(ImageViewerApplication &app, const QString &path, const QByteArray &format = {}, const DecodeHint & = {});
 	LoadedImage(const QImage &image);
 	virtual ~LoadedImage();
-	QColor get_background_color() override{
-		return this->background_color.result();
-	}
+	//Computed on first request.
+	QColor get_background_color() override;
 	bool is_animation() const override{
 		return false;
 	}
 	void assign_to_QLabel(QLabel &) override;
 	QImage get_QImage() const override;
+	void set_display_scale(QLabel &, double) override;
+	void draw(QPainter &, const QRect &dst) override;
+	QRect get_opaque_rect() const override;
 };
 
 class LoadedAnimation : public LoadedGraphics{
+	ImageViewerApplication *app;
+	QString path;
+	QByteArray format;
+	QLabel *label = nullptr;
+	//Normally frames come from a store shared with other viewports, and this
+	//object only keeps track of which one to display.
+	std::shared_ptr<AnimationFrames> frames;
+	std::chrono::steady_clock::time_point t0;
+	size_t current_frame = 0;
+	bool current_frame_missing = true;
+	//Used if the animation is too large to be cached.
+	std::unique_ptr<AnimationStream> stream;
+	QPixmap stream_pixmap;
+	//Used if the animation couldn't be decoded any other way.
 	std::unique_ptr<QMovie> animation;
 
+	qint64 get_elapsed() const;
+	void fall_back_to_stream();
+	void fall_back_to_movie();
 public:
-	LoadedAnimation(ImageViewerApplication &app, const QString &path);
+	LoadedAnimation(ImageViewerApplication &app, const QString &path, const QByteArray &format = {});
+	~LoadedAnimation();
 	QColor get_background_color() override{
 		return QColor(0, 0, 0, 0);
 	}
@@ -72,9 +154,254 @@ public:
 	}
 	void assign_to_QLabel(QLabel &) override;
 	QImage get_QImage() const override;
+	void draw(QPainter &, const QRect &dst) override;
+	bool tick() override;
+	bool needs_ticks() const override{
+		return !this->animation;
+	}
+	qint64 get_dropped_frames() const;
 	QMovie &get_movie() const{
 		return *this->animation;
 	}
 };
 
+//Describes where the frames are in a sprite sheet.
+class SpriteSheetLayout{
+	//Either a grid of equally sized cells, read left to right and top to
+	//bottom...
+	QSize cell;
+	int count = 0;
+	//...or explicit rectangles.
+	std::vector<QRect> frames;
+	double fps = 0;
+public:
+	//Accepts either a cell size, optionally followed by a frame count
+	//("64x64", "64x64x10"), or the path to a JSON file. The JSON may be an
+	//array of frames, or an object with a "frames" array or object and an
+	//optional "fps". Frames in an object play in the natural order of their
+	//names. Each frame is either {"x", "y", "w", "h"} or an object
+	//with such a "frame" member, as written by common sprite packers.
+	//Throws ParserException.
+	static SpriteSheetLayout parse(const QString &);
+	std::vector<QRect> resolve(const QSize &sheet_size) const;
+	//0 if the description didn't specify a rate.
+	double get_fps() const{
+		return this->fps;
+	}
+};
+
+//Plays frames from sub-rectangles of a single decoded image. Nothing is
+//allocated per frame; draw() reads straight from the sheet.
+class LoadedSpriteSheet : public LoadedGraphics{
+	QPixmap sheet;
+	std::vector<QRect> frames;
+	double fps = 0;
+	std::chrono::steady_clock::time_point t0;
+	size_t current_frame = 0;
+
+public:
+	LoadedSpriteSheet(const QString &path, const SpriteSheetLayout &layout, double fps);
+	QColor get_background_color() override{
+		return QColor(0, 0, 0, 0);
+	}
+	bool is_animation() const override{
+		return true;
+	}
+	void assign_to_QLabel(QLabel &) override{}
+	QImage get_QImage() const override;
+	void draw(QPainter &, const QRect &dst) override;
+	bool tick() override;
+	bool needs_ticks() const override{
+		return this->frames.size() > 1 && this->fps > 0;
+	}
+};
+
+//Plays a directory of numbered images at a fixed rate. A few frames ahead
+//of the current one are decoded on the thread pool, and only that window is
+//kept in memory.
+class LoadedFlipbook : public LoadedGraphics{
+	QStringList files;
+	double fps;
+	size_t lookahead;
+	std::chrono::steady_clock::time_point t0;
+	//Decodes only hold the path and their cancellation flag, so the ones
+	//that are no longer wanted are flagged and left to finish on their own.
+	struct PendingFrame{
+		QFuture<QImage> image;
+		std::shared_ptr<std::atomic<bool>> cancelled;
+	};
+	std::map<size_t, PendingFrame> pending;
+	size_t current_frame = 0;
+	QPixmap current_pixmap;
+	//Last frame that was found to be late, so that it's only counted once.
+	size_t last_late_frame;
+	qint64 dropped_frames = 0;
+
+	void schedule(size_t first);
+public:
+	static const size_t default_lookahead = 8;
+
+	LoadedFlipbook(const QString &directory, double fps, size_t lookahead = default_lookahead);
+	~LoadedFlipbook();
+	QColor get_background_color() override{
+		return QColor(0, 0, 0, 0);
+	}
+	bool is_animation() const override{
+		return true;
+	}
+	void assign_to_QLabel(QLabel &) override{}
+	QImage get_QImage() const override{
+		return this->current_pixmap.toImage();
+	}
+	void draw(QPainter &, const QRect &dst) override;
+	bool tick() override;
+	bool needs_ticks() const override{
+		return this->files.size() > 1 && this->fps > 0;
+	}
+	//Frames whose decode hadn't finished by the time they were due.
+	qint64 get_dropped_frames() const{
+		return this->dropped_frames;
+	}
+};
+
+//Displays pixels that a client placed in a named shared memory segment,
+//without copying them. The segment stays attached, and so alive, for as
+//long as this object exists; clients release it by unloading or replacing
+//the window.
+//Clients that modify the pixels in place are responsible for not doing it
+//while the window may be painting.
+class LoadedRawImage : public LoadedGraphics{
+	std::unique_ptr<QSharedMemory> memory;
+	//Wraps the segment's memory.
+	QImage image;
+	QRect opaque_rect;
+	Optional<QColor> background_color;
+public:
+	//format must be QImage::Format_ARGB32 or Format_ARGB32_Premultiplied.
+	//The object is null if the segment can't be attached or is too small
+	//for the given geometry.
+	LoadedRawImage(const QString &key, const QSize &size, int stride, QImage::Format format);
+	~LoadedRawImage();
+	QColor get_background_color() override;
+	bool is_animation() const override{
+		return false;
+	}
+	void assign_to_QLabel(QLabel &) override{}
+	//A deep copy, since the pixels belong to the segment and mustn't be
+	//used after it's detached.
+	QImage get_QImage() const override{
+		return this->image.copy();
+	}
+	void draw(QPainter &, const QRect &dst) override;
+	QRect get_opaque_rect() const override{
+		return this->opaque_rect;
+	}
+};
+
+//Vector images are rasterised at the zoom they are displayed at, rounded up
+//to a power of two. Rasterisation happens on the thread pool; until the
+//right bucket is ready, the closest one available is drawn scaled. Buckets
+//are capped at max_rasterisation_side, so a rasterisation never takes more
+//than 64 MiB; zooms past that draw the largest bucket scaled.
+class LoadedSvg : public LoadedGraphics{
+	QByteArray data;
+	QLabel *label = nullptr;
+	//Keyed by the base 2 logarithm of the scale.
+	std::map<int, QPixmap> rasterisations;
+	std::map<int, std::unique_ptr<QFutureWatcher<QImage>>> pending;
+	Optional<QColor> background_color;
+	int wanted_bucket = 0;
+
+	QSize get_bucket_size(int bucket) const;
+	void request_bucket(int bucket);
+	void rasterisation_ready(int bucket);
+	void evict();
+public:
+	static const int max_cached_rasterisations = 4;
+	static const int max_rasterisation_side = 4096;
+
+	LoadedSvg(const QString &path);
+	QColor get_background_color() override;
+	bool is_animation() const override{
+		return false;
+	}
+	void assign_to_QLabel(QLabel &label) override{
+		this->label = &label;
+	}
+	QImage get_QImage() const override;
+	void set_display_scale(QLabel &, double) override;
+	void draw(QPainter &, const QRect &dst) override;
+};
+
+//Displays images too large to hold in a single pixmap. The image is cut
+//into fixed-size tiles that are decoded on the thread pool when they first
+//become visible, using QImageReader::setClipRect. Tiles exist for a chain
+//of mip levels, each half the resolution of the previous one, and draw()
+//uses the coarsest level that still covers every device pixel. Tiles that
+//are visible stay resident; the rest are kept in an LRU cache, and the
+//cache plus the decodes in flight never exceed tile_cache_budget. A
+//downscaled overview is drawn underneath, and instead of the tiles when
+//zoomed out far enough or if they can't be decoded.
+//The full-resolution image is never held in memory. Formats that can't
+//decode clipped regions are only shown as a downscaled overview, and are
+//rejected if even that would require a decode larger than the budget.
+class LoadedTiledImage : public LoadedGraphics{
+	typedef quint64 tile_key_t;
+	struct CachedTile{
+		QPixmap pixmap;
+		qint64 bytes;
+		std::list<tile_key_t>::iterator lru_position;
+	};
+	struct PendingTile{
+		std::unique_ptr<QFutureWatcher<QImage>> watcher;
+		qint64 bytes;
+	};
+
+	QString path;
+	QByteArray format;
+	QImage overview_image;
+	QPixmap overview;
+	QLabel *label = nullptr;
+	//-1 if the format can't decode clipped regions, in which case there are
+	//no tiles.
+	int max_level = -1;
+	std::unordered_map<tile_key_t, CachedTile> tiles;
+	//Most recently used at the front.
+	std::list<tile_key_t> lru;
+	//Tiles drawn by the last call to draw_tiles().
+	std::unordered_set<tile_key_t> visible;
+	qint64 cached_bytes = 0;
+	qint64 pending_bytes = 0;
+	std::map<tile_key_t, PendingTile> pending;
+
+	QRect get_tile_rect(int level, int x, int y) const;
+	void request_tile(tile_key_t, const QRect &, const QSize &decoded_size);
+	void tile_ready(tile_key_t);
+	//Evicts the least recently used tiles that aren't visible until another
+	//bytes fit in the budget. Returns false if they can't.
+	bool make_room(qint64 bytes);
+	void draw_tiles(QPainter &);
+public:
+	static const int tile_size = 512;
+	static const qint64 tile_cache_budget = (qint64)256 << 20;
+	static const int overview_size = 2048;
+	//Used instead of overview_size when there are no tiles.
+	static const int fallback_size = 4096;
+
+	LoadedTiledImage(const QString &path, const QByteArray &format, const QSize &size);
+	//Decides whether an image of the given size should be tiled.
+	static bool should_tile(const QSize &);
+	QColor get_background_color() override;
+	bool is_animation() const override{
+		return false;
+	}
+	void assign_to_QLabel(QLabel &label) override{
+		this->label = &label;
+	}
+	QImage get_QImage() const override{
+		return this->overview_image;
+	}
+	void draw(QPainter &, const QRect &dst) override;
+};
+
 #endif // LOADEDIMAGE_H
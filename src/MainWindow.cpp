@@ -13,6 +13,8 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include <QImage>
 #include <QMetaEnum>
 #include <QDir>
+#include <QScreen>
+#include <QGuiApplication>
 #include <exception>
 #include <cassert>
 #include "GenericException.h"
@@ -26,6 +28,9 @@ MainWindow::MainWindow(ImageViewerApplication &app, const QRect &geom, QWidget *
 	this->origin = -geom.topLeft();
 	//this->open_path_and_display_image(path);
 	this->setAttribute(Qt::WA_TranslucentBackground);
+	this->pending_timer.setSingleShot(true);
+	this->pending_timer.setTimerType(Qt::PreciseTimer);
+	connect(&this->pending_timer, &QTimer::timeout, this, [this](){ this->apply_pending(); });
 	this->show();
 }
 
@@ -228,16 +233,74 @@ double MainWindow::get_image_zoom() const{
 	return this->window_state->get_zoom();
 }
 
-void MainWindow::load(const QString &path, std::string &&name){
-	auto image = LoadedImage::create(*this->app, path);
-	if (!image)
-		return;
+MainWindow::handle_t MainWindow::load(const QString &path, std::string &&name, const DecodeHint &hint){
+	return this->finish_load(LoadedImage::create(*this->app, path, hint), std::move(name), path);
+}
+
+MainWindow::handle_t MainWindow::load_sprite_sheet(const QString &path, std::string &&name, const SpriteSheetLayout &layout, double fps){
+	std::unique_ptr<LoadedGraphics> image(new LoadedSpriteSheet(path, layout, fps));
+	return this->finish_load(std::move(image), std::move(name), path);
+}
+
+MainWindow::handle_t MainWindow::load_flipbook(const QString &directory, std::string &&name, double fps, size_t lookahead){
+	std::unique_ptr<LoadedGraphics> image(new LoadedFlipbook(directory, fps, lookahead));
+	return this->finish_load(std::move(image), std::move(name), directory);
+}
+
+MainWindow::handle_t MainWindow::load_raw(const QString &key, std::string &&name, const QSize &size, int stride, QImage::Format format){
+	std::unique_ptr<LoadedGraphics> image(new LoadedRawImage(key, size, stride, format));
+	return this->finish_load(std::move(image), std::move(name), key);
+}
+
+MainWindow::handle_t MainWindow::finish_load(std::unique_ptr<LoadedGraphics> &&image, std::string &&name, const QString &path){
+	if (!image || image->is_null()){
+		this->post_event(EventType::LoadFailed, HandleTable<sharedp_t>::null_handle, name, path);
+		return HandleTable<sharedp_t>::null_handle;
+	}
+	auto handle = this->add_viewport(std::move(image), std::string(name));
+	auto window = this->get_window(handle);
+	if (window)
+		this->post_event(EventType::LoadFinished, handle, window->get_name(), path);
+	else
+		this->post_event(EventType::LoadFailed, HandleTable<sharedp_t>::null_handle, name, path);
+	return handle;
+}
+
+void MainWindow::post_event(EventType type, handle_t handle, const std::string &name, const QString &detail){
+	CommandEvent event;
+	event.type = type;
+	event.handle = handle;
+	event.window = QString::fromStdString(name);
+	event.detail = detail;
+	this->app->post_event(event);
+}
+
+MainWindow::handle_t MainWindow::add_viewport(std::unique_ptr<LoadedGraphics> &&image, std::string &&name){
 	auto geometry = this->geometry();
 	auto viewport = std::make_shared<ImageViewport>(std::move(name), geometry.size(), this/*->ui->centralWidget*/);
 	//this->ui->label->set_image(LoadedImage::create(*this->app, path));
 	viewport->set_image(std::move(image), geometry.size());
+	auto handle = this->windows_by_handle.add(sharedp_t(viewport));
+	//If the table is full, the viewport is destroyed before it's ever shown
+	//or registered.
+	if (handle == HandleTable<sharedp_t>::null_handle)
+		return handle;
+	viewport->set_handle(handle);
 	viewport->show();
-	this->windows_by_name[viewport->get_name()] = viewport;
+	viewport->set_event_sink([this](ImageViewport &viewport, EventType type){
+		this->post_event(type, viewport.get_handle(), viewport.get_name());
+	});
+	auto &slot = this->windows_by_name[viewport->get_name()];
+	this->app->get_command_stats().touch(handle);
+	if (slot){
+		//The new window takes the old one's place in its groups.
+		auto old_handle = slot->get_handle();
+		this->windows_by_handle.remove(old_handle);
+		for (auto &kv : this->groups)
+			std::replace(kv.second.begin(), kv.second.end(), old_handle, handle);
+	}
+	slot = viewport;
+	return handle;
 }
 
 MainWindow::sharedp_t MainWindow::get_window(const std::string &name){
@@ -246,3 +309,187 @@ MainWindow::sharedp_t MainWindow::get_window(const std::string &name){
 		return {};
 	return it->second;
 }
+
+//'*' matches any sequence of characters and '?' matches any one character.
+static bool glob_match(const char *pattern, const char *s){
+	const char *star = nullptr;
+	const char *resume = nullptr;
+	while (*s){
+		if (*pattern == '?' || (*pattern != '*' && *pattern == *s)){
+			pattern++;
+			s++;
+		}else if (*pattern == '*'){
+			star = pattern++;
+			resume = s;
+		}else if (star){
+			pattern = star + 1;
+			s = ++resume;
+		}else
+			return false;
+	}
+	while (*pattern == '*')
+		pattern++;
+	return !*pattern;
+}
+
+bool is_window_pattern(const QString &s){
+	return s.contains('*') || s.contains('?');
+}
+
+void MainWindow::for_each_window(const QString &target, const std::function<void(ImageViewport &)> &_f){
+	//Lets the statistics attribute the next paint of each window to the
+	//running command.
+	auto &stats = this->app->get_command_stats();
+	auto f = [&stats, &_f](ImageViewport &window){
+		stats.touch(window.get_handle());
+		_f(window);
+	};
+	quint32 handle;
+	if (parse_handle(handle, target)){
+		auto window = this->get_window(handle);
+		if (!window)
+			throw CommandException("invalid or stale handle");
+		f(*window);
+		return;
+	}
+	if (target.startsWith('%')){
+		auto it = this->groups.find(target.mid(1).toStdString());
+		if (it == this->groups.end())
+			throw CommandException("no such group");
+		auto &members = it->second;
+		members.erase(std::remove_if(members.begin(), members.end(), [this](handle_t h){ return !this->windows_by_handle.get(h); }), members.end());
+		for (auto h : members)
+			f(**this->windows_by_handle.get(h));
+		return;
+	}
+	auto name = target.toStdString();
+	if (!is_window_pattern(target)){
+		auto window = this->get_window(name);
+		if (!window)
+			throw CommandException("no such window");
+		f(*window);
+		return;
+	}
+	//Names are kept sorted, so only the windows that share the pattern's
+	//literal prefix need to be matched.
+	auto prefix_size = name.find_first_of("*?");
+	auto prefix = name.substr(0, prefix_size);
+	auto pattern = name.c_str() + prefix_size;
+	for (auto it = this->windows_by_name.lower_bound(prefix); it != this->windows_by_name.end(); ++it){
+		if (it->first.compare(0, prefix_size, prefix))
+			break;
+		if (glob_match(pattern, it->first.c_str() + prefix_size))
+			f(*it->second);
+	}
+}
+
+bool MainWindow::create_group(const std::string &group){
+	return this->groups.emplace(group, std::vector<handle_t>()).second;
+}
+
+bool MainWindow::delete_group(const std::string &group){
+	return this->groups.erase(group) != 0;
+}
+
+size_t MainWindow::add_to_group(const std::string &group, const QString &target){
+	auto it = this->groups.find(group);
+	if (it == this->groups.end())
+		throw CommandException("no such group");
+	//The target may be the group itself, so it can't be modified while the
+	//target is being resolved.
+	std::vector<handle_t> added;
+	this->for_each_window(target, [&added](ImageViewport &window){
+		added.push_back(window.get_handle());
+	});
+	auto &members = it->second;
+	auto size = members.size();
+	for (auto h : added)
+		if (std::find(members.begin(), members.end(), h) == members.end())
+			members.push_back(h);
+	return members.size() - size;
+}
+
+size_t MainWindow::remove_from_group(const std::string &group, const QString &target){
+	auto it = this->groups.find(group);
+	if (it == this->groups.end())
+		throw CommandException("no such group");
+	auto &members = it->second;
+	auto size = members.size();
+	std::vector<handle_t> removed;
+	this->for_each_window(target, [&removed](ImageViewport &window){
+		removed.push_back(window.get_handle());
+	});
+	members.erase(std::remove_if(members.begin(), members.end(), [&removed](handle_t h){ return std::find(removed.begin(), removed.end(), h) != removed.end(); }), members.end());
+	return size - members.size();
+}
+
+size_t MainWindow::unload(const QString &target){
+	std::vector<handle_t> handles;
+	this->for_each_window(target, [&handles](ImageViewport &window){
+		handles.push_back(window.get_handle());
+	});
+	for (auto handle : handles){
+		auto window = this->get_window(handle);
+		this->windows_by_handle.remove(handle);
+		auto it = this->windows_by_name.find(window->get_name());
+		if (it != this->windows_by_name.end() && it->second == window)
+			this->windows_by_name.erase(it);
+		//Groups drop stale handles when they're next used.
+		window->hide();
+	}
+	return handles.size();
+}
+
+int MainWindow::get_frame_interval(){
+	auto screen = QGuiApplication::primaryScreen();
+	auto rate = screen ? screen->refreshRate() : 0;
+	if (rate <= 1)
+		rate = 60;
+	return std::max((int)(1000 / rate), 1);
+}
+
+void MainWindow::queue_move(ImageViewport &window, const relabsint &x, const relabsint &y){
+	auto was_pending = window.has_pending();
+	this->queued(window, was_pending, window.queue_move(x, y));
+}
+
+void MainWindow::queue_rotation(ImageViewport &window, const relabsdouble &theta){
+	auto was_pending = window.has_pending();
+	this->queued(window, was_pending, window.queue_rotation(theta));
+}
+
+void MainWindow::queue_scale(ImageViewport &window, double scale){
+	auto was_pending = window.has_pending();
+	this->queued(window, was_pending, window.queue_scale(scale));
+}
+
+void MainWindow::queued(ImageViewport &window, bool was_pending, bool coalesced){
+	if (coalesced)
+		this->app->get_command_stats().add_coalesced();
+	if (was_pending)
+		return;
+	this->pending_viewports.push_back(window.get_handle());
+	if (this->pending_timer.isActive())
+		return;
+	//The first change after an idle period goes out right away; after that,
+	//at most once per frame.
+	qint64 wait = 0;
+	if (this->last_pending_apply.isValid())
+		wait = std::max<qint64>(get_frame_interval() - this->last_pending_apply.elapsed(), 0);
+	this->pending_timer.start((int)wait);
+}
+
+void MainWindow::apply_pending(){
+	this->pending_timer.stop();
+	if (this->pending_viewports.empty())
+		return;
+	auto pending = std::move(this->pending_viewports);
+	this->pending_viewports.clear();
+	ImageViewport::RepaintBatch batch;
+	for (auto handle : pending){
+		auto window = this->get_window(handle);
+		if (window)
+			window->apply_pending();
+	}
+	this->last_pending_apply.start();
+}
@@ -14,11 +14,14 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "Misc.h"
 #include "Settings.h"
 #include "ImageViewport.h"
+#include "HandleTable.h"
 #include <QMainWindow>
 #include <QMouseEvent>
 #include <QDesktopWidget>
 #include <QStringList>
 #include <QShortcut>
+#include <QTimer>
+#include <QElapsedTimer>
 #include <vector>
 #include <memory>
 #include <chrono>
@@ -40,11 +43,15 @@ public:
 	MouseEvent &operator=(const MouseEvent &) = default;
 };
 
+//Whether a target contains wildcards.
+bool is_window_pattern(const QString &);
+
 class MainWindow : public QMainWindow{
 	Q_OBJECT
 
 public:
 	typedef std::shared_ptr<ImageViewport> sharedp_t;
+	typedef HandleTable<sharedp_t>::handle_t handle_t;
 protected:
 	std::shared_ptr<Ui::MainWindow> ui;
 	ImageViewerApplication *app;
@@ -66,6 +73,15 @@ protected:
 	bool not_moved;
 
 	std::map<std::string, sharedp_t> windows_by_name;
+	HandleTable<sharedp_t> windows_by_handle;
+	//Members of each group. Handles that went stale are dropped the next
+	//time the group is used.
+	std::map<std::string, std::vector<handle_t>> groups;
+	//Viewports with changes queued by commands, which apply_pending()
+	//applies once per frame.
+	std::vector<handle_t> pending_viewports;
+	QTimer pending_timer;
+	QElapsedTimer last_pending_apply;
 
 	enum class ResizeMode{
 		None        = 0,
@@ -106,6 +122,15 @@ protected:
 	void reposition_image();
 	void clear_image_pos();
 	void rotate(bool right, bool fine = false);
+	handle_t add_viewport(std::unique_ptr<LoadedGraphics> &&, std::string &&name);
+	//Adds the viewport if the image loaded, and posts the load event.
+	handle_t finish_load(std::unique_ptr<LoadedGraphics> &&, std::string &&name, const QString &path);
+	void post_event(EventType, handle_t, const std::string &name, const QString &detail = {});
+	//Called after queueing a change in a viewport. was_pending is whether
+	//the viewport already had changes queued before.
+	void queued(ImageViewport &, bool was_pending, bool coalesced);
+	//Duration of a frame of the primary screen, in milliseconds.
+	static int get_frame_interval();
 
 	struct ZoomResult{
 		double zoom;
@@ -144,8 +169,48 @@ public:
 	ImageViewerApplication &get_app(){
 		return *this->app;
 	}
-	void load(const QString &path, std::string &&name);
+	//The load functions return the handle of the new window, or
+	//HandleTable::null_handle if the file couldn't be loaded. Loading a
+	//window with the name of an existing one replaces it, and invalidates
+	//the old window's handle.
+	handle_t load(const QString &path, std::string &&name, const DecodeHint & = {});
+	handle_t load_sprite_sheet(const QString &path, std::string &&name, const SpriteSheetLayout &, double fps);
+	handle_t load_flipbook(const QString &directory, std::string &&name, double fps, size_t lookahead);
+	//See LoadedRawImage.
+	handle_t load_raw(const QString &key, std::string &&name, const QSize &size, int stride, QImage::Format format);
 	sharedp_t get_window(const std::string &name);
+	//Returns null if the handle is stale.
+	sharedp_t get_window(handle_t handle){
+		auto p = this->windows_by_handle.get(handle);
+		return p ? *p : sharedp_t();
+	}
+	//Calls f for every window the target refers to: a name, a handle
+	//("#<handle>"), a group ("%<group>") or a pattern over names in which
+	//'*' and '?' are wildcards ("enemy*"). Throws CommandException if a
+	//name, handle or group doesn't exist. Patterns may match nothing.
+	void for_each_window(const QString &target, const std::function<void(ImageViewport &)> &f);
+	//Both return false if the group already exists or doesn't exist,
+	//respectively.
+	bool create_group(const std::string &);
+	bool delete_group(const std::string &);
+	//Both take any target for_each_window() accepts, throw CommandException
+	//if the group doesn't exist and return how many members were added or
+	//removed.
+	size_t add_to_group(const std::string &group, const QString &target);
+	size_t remove_from_group(const std::string &group, const QString &target);
+	//Closes every window the target refers to and frees its image,
+	//invalidating the handles. Returns how many windows were closed.
+	size_t unload(const QString &target);
+	//Command versions of the viewport setters. Changes to the same viewport
+	//are folded together (see ImageViewport::queue_move()) and applied in
+	//the next frame, so a burst of commands costs a single repaint.
+	void queue_move(ImageViewport &, const relabsint &x, const relabsint &y);
+	void queue_rotation(ImageViewport &, const relabsdouble &theta);
+	void queue_scale(ImageViewport &, double scale);
+	//Applies the queued changes right away instead of in the next frame.
+	//Batches call it so that their queued changes show up in the same
+	//frame as the ones that apply immediately.
+	void apply_pending();
 
 public slots:
 	void quit_slot();
@@ -212,4 +212,37 @@ inline void to_lower(std::string &s){
 	std::transform(s.begin(), s.end(), s.begin(), tolower);
 }
 
+//Sets a variable for the lifetime of the object and restores its old value
+//afterwards.
+template <typename T>
+class AutoSetter{
+	T *dst;
+	T old_value;
+public:
+	AutoSetter(): dst(nullptr){}
+	AutoSetter(T &dst, T new_value): dst(&dst), old_value(dst){
+		*this->dst = new_value;
+	}
+	AutoSetter(const AutoSetter &) = delete;
+	AutoSetter &operator=(const AutoSetter &) = delete;
+	AutoSetter(AutoSetter &&other){
+		*this = std::move(other);
+	}
+	AutoSetter &operator=(AutoSetter &&other){
+		this->dst = other.dst;
+		other.dst = nullptr;
+		this->old_value = std::move(other.old_value);
+		return *this;
+	}
+	~AutoSetter(){
+		if (this->dst)
+			*this->dst = this->old_value;
+	}
+};
+
+template <typename T>
+AutoSetter<T> autoset(T &dst, T value){
+	return AutoSetter<T>(dst, value);
+}
+
 #endif // MISC_H
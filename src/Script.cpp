@@ -117,6 +117,34 @@ std::string to_string(const std::deque<QChar> &input){
 	return ret;
 }
 
+//Either a double-quoted string or a run of non-whitespace characters.
+QString expect_string(std::deque<QChar> &input){
+	skip_whitespace(input);
+	if (EMPTY)
+		throw ParserException("expected string but found end of line");
+	QString ret;
+	if (PEEK != '"'){
+		while (!EMPTY && !PEEK.isSpace())
+			ret += POP;
+		return ret;
+	}
+	POP;
+	while (true){
+		if (EMPTY)
+			throw ParserException("unterminated string");
+		auto c = POP;
+		if (c == '"')
+			break;
+		ret += c;
+	}
+	return ret;
+}
+
+bool at_eol(std::deque<QChar> &input){
+	skip_whitespace(input);
+	return EMPTY;
+}
+
 void expect_eol(std::deque<QChar> &input){
 	skip_whitespace(input);
 	if (!EMPTY)
@@ -304,6 +332,15 @@ std::unique_ptr<ScriptCommand> expect_line(std::deque<QChar> &input){
 		auto speed = expect_real(input);
 		return std::make_unique<AnimRotateCommand>(speed);
 	}
+	if (identifier == "loadsheet"){
+		auto path = expect_string(input);
+		auto layout = SpriteSheetLayout::parse(expect_string(input));
+		double fps = 0;
+		if (!at_eol(input))
+			fps = expect_real(input);
+		expect_eol(input);
+		return std::make_unique<LoadSheetCommand>(path, layout, fps);
+	}
 	if (identifier == "wait"){
 		auto animmove = expect_identifier(input).toLower();
 		if (animmove != "animmove")
@@ -68,3 +68,8 @@ void WaitAnimMoveCommand::resume(InterpreterState &state, ImageViewport &image){
 		});
 	}
 }
+
+void LoadSheetCommand::resume(InterpreterState &state, ImageViewport &image){
+	image.load_sprite_sheet(this->path, this->layout, this->fps);
+	state.currently_running++;
+}
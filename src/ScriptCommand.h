@@ -8,6 +8,7 @@ Distributed under a permissive license. See COPYING.txt for details.
 #pragma once
 
 #include "Script.h"
+#include "LoadedImage.h"
 
 class WhileCommand : public ScriptCommand{
 public:
@@ -84,3 +85,12 @@ public:
 	AnimRotateCommand(double speed): speed(speed){}
 	void resume(InterpreterState &state, ImageViewport &image) override;
 };
+
+class LoadSheetCommand : public ScriptCommand{
+	QString path;
+	SpriteSheetLayout layout;
+	double fps;
+public:
+	LoadSheetCommand(const QString &path, const SpriteSheetLayout &layout, double fps): path(path), layout(layout), fps(fps){}
+	void resume(InterpreterState &state, ImageViewport &image) override;
+};
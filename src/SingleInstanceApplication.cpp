@@ -6,6 +6,7 @@ Distributed under a permissive license. See COPYING.txt for details.
 */
 
 #include "SingleInstanceApplication.h"
+#include "CommandConnection.h"
 #include "GenericException.h"
 #include <QtNetwork/QLocalSocket>
 #include <QDataStream>
@@ -13,6 +14,12 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include "Misc.h"
 #include "MainWindow.h"
 #include <QProcess>
+#include <QTimer>
+#include <QDebug>
+#include <QCoreApplication>
+#include <algorithm>
+#include <limits>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 
@@ -34,6 +41,18 @@ SingleInstanceApplication::SingleInstanceApplication(int &argc, char **argv, con
 		QApplication(argc, argv),
 		running(false),
 		unique_name(unique_name){
+	this->clock.start();
+	this->schedule_timer.setSingleShot(true);
+	this->schedule_timer.setTimerType(Qt::PreciseTimer);
+	connect(&this->schedule_timer, &QTimer::timeout, this, [this](){ this->run_scheduled(); });
+	bool ok;
+	auto stats_interval = qEnvironmentVariableIntValue("BORDERLESS_STATS_INTERVAL", &ok);
+	if (!ok)
+		stats_interval = default_stats_interval;
+	if (stats_interval > 0){
+		connect(&this->stats_timer, &QTimer::timeout, this, [this](){ this->log_stats(); });
+		this->stats_timer.start(stats_interval * 1000);
+	}
 #ifndef DISABLE_SINGLE_INSTANCE
 	this->args = this->arguments();
 	bool success = false;
@@ -67,6 +86,41 @@ SingleInstanceApplication::SingleInstanceApplication(int &argc, char **argv, con
 #endif
 }
 
+SingleInstanceApplication::~SingleInstanceApplication(){
+	this->connections.clear();
+}
+
+bool SingleInstanceApplication::forward_to_running_instance(int &argc, char **argv, const QString &unique_name, const QElapsedTimer &clock){
+#ifdef DISABLE_SINGLE_INSTANCE
+	return false;
+#else
+	bool report_timing = qEnvironmentVariableIsSet("BORDERLESS_CLIENT_TIMING");
+	QCoreApplication app(argc, argv);
+	QLocalSocket socket;
+	socket.connectToServer(unique_name, QIODevice::ReadWrite);
+	//If nothing is listening the connection fails immediately, so this
+	//doesn't slow down the first launch.
+	if (!socket.waitForConnected(timeout))
+		return false;
+	socket.write(to_QByteArray(app.arguments()));
+	if (!socket.waitForBytesWritten(timeout))
+		return false;
+	auto sent = clock.nsecsElapsed();
+	QByteArray response;
+	while (response.size() < (int)sizeof(qint64) && socket.waitForReadyRead(timeout))
+		response.append(socket.readAll());
+	if (response.size() < (int)sizeof(qint64))
+		return false;
+	qint64 server_pid;
+	memcpy(&server_pid, response.constData(), sizeof(server_pid));
+	allow_set_foreground_window(server_pid);
+	socket.disconnectFromServer();
+	if (report_timing)
+		std::cerr << "startup to send: " << sent / 1000 << " us, to reply: " << clock.nsecsElapsed() / 1000 << " us\n";
+	return true;
+#endif
+}
+
 void SingleInstanceApplication::clear_shared_memory(){
 #ifndef WIN32
 	QFile file("/tmp/" + unique_name);
@@ -77,18 +131,110 @@ void SingleInstanceApplication::clear_shared_memory(){
 }
 
 void SingleInstanceApplication::receive_message(){
-	auto socket = this->local_server->nextPendingConnection();
-	if (!socket->waitForReadyRead(this->timeout))
+	while (auto socket = this->local_server->nextPendingConnection())
+		this->open_command_connection(socket, QByteArray());
+}
+
+void SingleInstanceApplication::open_command_connection(QLocalSocket *socket, const QByteArray &initial_data){
+	auto dispatcher = [this](const QStringList &args){ return this->new_instance(args); };
+	auto connection = std::make_unique<CommandConnection>(socket, dispatcher, this->applicationPid(), initial_data);
+	connection->set_batch_dispatcher([this](const std::vector<QStringList> &commands){ return this->new_batch(commands); });
+	connection->set_binary_dispatcher([this](const BinaryCommand &command, const std::string &target){ return this->new_binary_instance(command, target); });
+	connection->set_group_runner([this](const std::function<void()> &f){ this->run_grouped(f); });
+	connection->set_stats(&this->command_stats);
+	connection->set_scheduler([this](qint64 time, std::function<void()> &&f, const QString &type){ this->schedule(time, std::move(f), type); });
+	connection->on_closed = [this, socket](){
+		//The connection is still on the stack at this point.
+		QTimer::singleShot(0, this, [this, socket](){
+			this->connections.erase(socket);
+			socket->deleteLater();
+		});
+	};
+	auto p = connection.get();
+	this->connections[socket] = std::move(connection);
+	p->start();
+}
+
+void SingleInstanceApplication::schedule(qint64 time, std::function<void()> &&f, const QString &type){
+	ScheduledCommand command;
+	command.time = time;
+	command.order = this->next_schedule_order++;
+	command.run = std::move(f);
+	command.type = type;
+	this->scheduled.push_back(std::move(command));
+	std::push_heap(this->scheduled.begin(), this->scheduled.end(), std::greater<ScheduledCommand>());
+	this->arm_schedule_timer();
+}
+
+void SingleInstanceApplication::arm_schedule_timer(){
+	if (this->scheduled.empty()){
+		this->schedule_timer.stop();
 		return;
+	}
+	auto wait = this->scheduled.front().time - this->get_clock();
+	//Round up, so the timer doesn't fire just before the deadline.
+	this->schedule_timer.start((int)std::min<qint64>(std::max<qint64>((wait + 999) / 1000, 0), std::numeric_limits<int>::max()));
+}
 
-	auto byte_msg = socket->readAll();
-	{
-		qint64 pid = this->applicationPid();
-		socket->write(QByteArray((const char *)&pid, sizeof(pid)));
-		socket->waitForBytesWritten(this->timeout);
+void SingleInstanceApplication::run_scheduled(){
+	auto now = this->get_clock();
+	auto &heap = this->scheduled;
+	if (!heap.empty() && heap.front().time <= now){
+		auto &stats = this->command_stats;
+		this->run_grouped([&heap, &stats, now](){
+			while (!heap.empty() && heap.front().time <= now){
+				std::pop_heap(heap.begin(), heap.end(), std::greater<ScheduledCommand>());
+				auto f = std::move(heap.back().run);
+				auto type = std::move(heap.back().type);
+				heap.pop_back();
+				if (type.isEmpty()){
+					//May schedule more commands.
+					f();
+					continue;
+				}
+				//Timed on its own, so that the viewports it changes aren't
+				//charged to another command.
+				CommandStats::Timing timing;
+				timing.received = timing.dispatched = get_timestamp();
+				stats.start_command();
+				f();
+				timing.completed = get_timestamp();
+				stats.record(type, timing);
+			}
+		});
 	}
-	socket->waitForDisconnected(this->timeout);
-	this->new_instance(to_QStringList(byte_msg));
+	this->arm_schedule_timer();
+}
+
+void SingleInstanceApplication::log_stats(){
+	auto recorded = this->command_stats.get_recorded();
+	//Nothing new to say.
+	if (recorded == this->last_logged_commands)
+		return;
+	this->last_logged_commands = recorded;
+	qDebug().noquote() << "Command latencies (us):\n" + this->command_stats.report();
+}
+
+void SingleInstanceApplication::post_event(const CommandEvent &event){
+	for (auto &kv : this->connections)
+		kv.second->post_event(event);
+}
+
+std::vector<CommandResult> SingleInstanceApplication::new_batch(const std::vector<QStringList> &commands){
+	std::vector<CommandResult> ret;
+	ret.reserve(commands.size());
+	for (auto &args : commands)
+		ret.push_back(this->new_instance(args));
+	return ret;
+}
+
+CommandResult SingleInstanceApplication::new_binary_instance(const BinaryCommand &command, const std::string &target){
+	auto by_handle = !!(command.flags & (quint16)CommandFlags::TargetIsHandle);
+	auto args = command.to_QStringList(by_handle ? format_handle(command.target) : QString::fromStdString(target));
+	if (args.isEmpty())
+		return CommandResult(false, "unknown opcode");
+	args.prepend(QString());
+	return this->new_instance(args);
 }
 
 bool SingleInstanceApplication::communicate_with_server(QLocalSocket &socket, qint64 &server_pid, const QStringList &list){
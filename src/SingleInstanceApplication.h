@@ -12,15 +12,22 @@ Distributed under a permissive license. See COPYING.txt for details.
 #include <QSharedMemory>
 #include <QtNetwork/QLocalServer>
 #include <QByteArray>
+#include <QElapsedTimer>
 #include <QStringList>
+#include <QTimer>
 #include <memory>
 #include "DirectoryListing.h"
+#include "CommandProtocol.h"
+#include "CommandStats.h"
 #include <map>
 #include <vector>
 #include <utility>
 #include <exception>
+#include <functional>
 
 class MainWindow;
+class CommandConnection;
+class QLocalSocket;
 
 class ApplicationAlreadyRunningException : public std::exception{};
 
@@ -31,6 +38,31 @@ class SingleInstanceApplication : public QApplication{
 	QString unique_name;
 	std::unique_ptr<QSharedMemory> shared_memory;
 	std::shared_ptr<QLocalServer> local_server;
+	std::map<QLocalSocket *, std::unique_ptr<CommandConnection>> connections;
+
+	struct ScheduledCommand{
+		qint64 time;
+		//Breaks ties, so that commands scheduled for the same time run in
+		//the order they were scheduled.
+		quint64 order;
+		std::function<void()> run;
+		//Empty if run isn't a command, or times itself.
+		QString type;
+
+		bool operator>(const ScheduledCommand &other) const{
+			if (this->time != other.time)
+				return this->time > other.time;
+			return this->order > other.order;
+		}
+	};
+	QElapsedTimer clock;
+	//Min-heap on time.
+	std::vector<ScheduledCommand> scheduled;
+	quint64 next_schedule_order = 0;
+	QTimer schedule_timer;
+	CommandStats command_stats;
+	QTimer stats_timer;
+	quint64 last_logged_commands = 0;
 
 	static const int timeout = 1000;
 
@@ -40,17 +72,57 @@ class SingleInstanceApplication : public QApplication{
 	bool communicate_with_server(QLocalSocket &socket, qint64 &server_pid, const QStringList &list);
 	bool communicate_with_server(QLocalSocket &socket, QByteArray &response, const QByteArray &msg);
 	void clear_shared_memory();
+	void open_command_connection(QLocalSocket *, const QByteArray &initial_data);
+	void run_scheduled();
+	void arm_schedule_timer();
+	void log_stats();
 
 protected:
 	QStringList args;
-	virtual void new_instance(const QStringList &args) = 0;
+	virtual CommandResult new_instance(const QStringList &args) = 0;
+	//Runs the commands in order. By default they're just passed to
+	//new_instance() one by one.
+	virtual std::vector<CommandResult> new_batch(const std::vector<QStringList> &commands);
+	//Runs f, which executes several commands in a row. By default it's just
+	//called.
+	virtual void run_grouped(const std::function<void()> &f){
+		f();
+	}
+	//By default, binary commands are converted to string commands.
+	virtual CommandResult new_binary_instance(const BinaryCommand &, const std::string &target);
 
 public:
 	//May throw ApplicationAlreadyRunningException.
 	explicit SingleInstanceApplication(int &argc, char **argv, const QString &unique_name);
+	//Sends the command line to an instance that is already running, if there
+	//is one, using only a QCoreApplication. Returns false if no instance
+	//answered, in which case the caller should become the instance.
+	//If BORDERLESS_CLIENT_TIMING is set, the time since clock was started is
+	//printed when the command is sent and when the server answers.
+	static bool forward_to_running_instance(int &argc, char **argv, const QString &unique_name, const QElapsedTimer &clock);
+	~SingleInstanceApplication();
 	bool is_running() const{
 		return this->running;
 	}
+	//Notifies every persistent connection that subscribed to the event.
+	void post_event(const CommandEvent &);
+	//Monotonic time since the server started, in microseconds. Scheduled
+	//commands are timed against it.
+	qint64 get_clock() const{
+		return this->clock.nsecsElapsed() / 1000;
+	}
+	//Runs f once get_clock() reaches the time, or as soon as possible if it
+	//already has. Everything that comes due at once runs in a single group
+	//(see run_grouped()), so it shows up in the same frame. If type is set,
+	//f runs a command of that type, and is timed in the command statistics
+	//like one received from a client.
+	void schedule(qint64 time, std::function<void()> &&f, const QString &type = QString());
+	CommandStats &get_command_stats(){
+		return this->command_stats;
+	}
+	//How often the command statistics are logged, in seconds, unless
+	//BORDERLESS_STATS_INTERVAL says otherwise. 0 disables the log.
+	static const int default_stats_interval = 60;
 
 private:
 
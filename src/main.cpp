@@ -7,10 +7,70 @@ Distributed under a permissive license. See COPYING.txt for details.
 
 #include "ImageViewerApplication.h"
 
+#include <QDebug>
+#include <QFileInfo>
+#include <cstring>
+
 int main(int argc, char **argv){
+	QElapsedTimer clock;
+	clock.start();
 	try{
+		auto unique_name = "BorderlessAnimator" + get_per_user_unique_id();
+		//Leading options, each with a value:
+		//"--test-server <name>" starts a server under a name of its own, for
+		//tools such as the load generator. It doesn't interfere with a
+		//normal instance that may already be running.
+		//"--record <path>" records every command into a command log.
+		//"--replay <path>" runs the commands in a command log headless, then
+		//quits. "--replay-speed <x>" replays x times as fast as recorded, or
+		//as fast as possible if x is 0. The default is 1.
+		bool test_mode = false;
+		QString record_path,
+			replay_path;
+		double replay_speed = 1;
+		int consumed = 1;
+		for (; consumed + 1 < argc; consumed += 2){
+			auto option = argv[consumed];
+			auto value = QString::fromLocal8Bit(argv[consumed + 1]);
+			if (!strcmp(option, "--test-server")){
+				unique_name = value;
+				test_mode = true;
+			}else if (!strcmp(option, "--record"))
+				record_path = QFileInfo(value).absoluteFilePath();
+			else if (!strcmp(option, "--replay"))
+				replay_path = QFileInfo(value).absoluteFilePath();
+			else if (!strcmp(option, "--replay-speed"))
+				replay_speed = value.toDouble();
+			else
+				break;
+		}
+		if (consumed > 1){
+			argv[consumed - 1] = argv[0];
+			argv += consumed - 1;
+			argc -= consumed - 1;
+		}
+		if (!replay_path.isEmpty()){
+			if (!test_mode)
+				unique_name = QString("BorderlessReplay_%1").arg(QCoreApplication::applicationPid());
+			test_mode = true;
+			if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+				qputenv("QT_QPA_PLATFORM", "offscreen");
+		}
+		//Most invocations just pass a command to the running instance, so
+		//try that before paying for a QApplication.
+		if (!test_mode && argc > 1 && SingleInstanceApplication::forward_to_running_instance(argc, argv, unique_name, clock))
+			return 0;
 		initialize_supported_extensions();
-		ImageViewerApplication app(argc, argv, "BorderlessAnimator" + get_per_user_unique_id());
+		ImageViewerApplication app(argc, argv, unique_name, test_mode);
+		if (!record_path.isEmpty())
+			app.start_recording(record_path);
+		if (!replay_path.isEmpty()){
+			QString error;
+			if (!app.start_replay(replay_path, replay_speed, error)){
+				qDebug() << "Can't replay" << replay_path << ":" << error;
+				return 1;
+			}
+		}
 		return app.exec();
 	}catch (ApplicationAlreadyRunningException &){
 		return 0;
@@ -0,0 +1,109 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "Test.h"
+#include "CommandConnection.h"
+#include <QtNetwork/QLocalServer>
+#include <QtNetwork/QLocalSocket>
+#include <QEventLoop>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+namespace{
+
+const int timeout = 5000;
+const QStringList test_command = { "move", "sprite", "+1", "-1" };
+
+//Accepts a single connection and records the last command it received.
+class TestServer{
+	QLocalServer server;
+	std::unique_ptr<CommandConnection> connection;
+public:
+	QStringList received;
+
+	TestServer(const QString &name){
+		QLocalServer::removeServer(name);
+		this->server.listen(name);
+		QObject::connect(&this->server, &QLocalServer::newConnection, [this](){
+			auto socket = this->server.nextPendingConnection();
+			if (!socket || this->connection)
+				return;
+			auto dispatcher = [this](const QStringList &args){
+				this->received = args.mid(1);
+				return CommandResult();
+			};
+			this->connection = std::make_unique<CommandConnection>(socket, dispatcher, 0);
+			this->connection->start();
+		});
+	}
+};
+
+//Runs the client on its own thread while the server's event loop runs on
+//this one.
+bool run_client(const std::function<bool()> &f){
+	QEventLoop loop;
+	bool success = false;
+	std::thread thread([&](){
+		success = f();
+		QMetaObject::invokeMethod(&loop, "quit", Qt::QueuedConnection);
+	});
+	loop.exec();
+	thread.join();
+	return success;
+}
+
+//Sends the client hello one byte at a time, giving the server a chance to
+//read each byte separately, then runs a command.
+bool send_fragmented_hello(const QString &name){
+	QLocalSocket socket;
+	socket.connectToServer(name);
+	if (!socket.waitForConnected(timeout))
+		return false;
+	auto hello = make_client_hello();
+	for (int i = 0; i < hello.size(); i++){
+		socket.write(hello.constData() + i, 1);
+		if (!socket.waitForBytesWritten(timeout))
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	QByteArray server_hello;
+	while (server_hello.size() < command_server_hello_size){
+		if (!socket.bytesAvailable() && !socket.waitForReadyRead(timeout))
+			return false;
+		server_hello.append(socket.read(command_server_hello_size - server_hello.size()));
+	}
+	qint64 pid;
+	if (!parse_server_hello(server_hello, pid))
+		return false;
+	socket.write(make_command_frame(test_command));
+	if (!socket.waitForBytesWritten(timeout))
+		return false;
+	FrameReader reader;
+	reader.append(socket.readAll());
+	FrameType type;
+	QByteArray body;
+	while (!reader.next(type, body)){
+		if (!socket.waitForReadyRead(timeout))
+			return false;
+		reader.append(socket.readAll());
+	}
+	CommandReply reply;
+	return type == FrameType::Reply && parse_reply_body(reply, body) && reply.result.success;
+}
+
+}
+
+int connection_tests(){
+	int failed = 0;
+	failed += run_test("hello split into single bytes", [](){
+		const QString name = "BorderlessConnectionTest";
+		TestServer server(name);
+		return run_client([&](){ return send_fragmented_hello(name); }) && server.received == test_command;
+	});
+	return failed;
+}
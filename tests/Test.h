@@ -0,0 +1,23 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+//Runs f, prints whether it passed and returns 1 if it failed.
+inline int run_test(const std::string &name, const std::function<bool()> &f){
+	auto passed = f();
+	std::cout << std::left << std::setw(40) << name << (passed ? " passed\n" : " FAILED\n");
+	return passed ? 0 : 1;
+}
+
+#endif
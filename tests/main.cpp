@@ -0,0 +1,17 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include <QCoreApplication>
+
+int connection_tests();
+
+int main(int argc, char **argv){
+	QCoreApplication app(argc, argv);
+	int failed = 0;
+	failed += connection_tests();
+	return failed;
+}
@@ -0,0 +1,30 @@
+#-------------------------------------------------
+#
+# Tests for the parts of Borderless that don't need a display.
+# Build with qmake && make, then run ./tests; the exit code is the number of
+# failed tests.
+#
+#-------------------------------------------------
+
+QT += core network
+QT -= gui widgets
+
+TARGET = tests
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+QMAKE_CXXFLAGS += -std=c++14
+INCLUDEPATH += $$PWD/../src
+
+SOURCES +=  ConnectionTest.cpp            \
+            main.cpp                      \
+            ../src/CommandConnection.cpp  \
+            ../src/CommandProtocol.cpp    \
+            ../src/CommandRing.cpp        \
+            ../src/CommandStats.cpp
+
+HEADERS +=  Test.h                        \
+            ../src/CommandConnection.h    \
+            ../src/CommandProtocol.h      \
+            ../src/CommandRing.h          \
+            ../src/CommandStats.h
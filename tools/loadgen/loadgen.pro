@@ -0,0 +1,29 @@
+#-------------------------------------------------
+#
+# Load generator for the Borderless command server.
+# Build with qmake && make and run ./loadgen --help.
+# It starts its own headless server, so the Borderless
+# executable must have been built first.
+#
+#-------------------------------------------------
+
+QT += core gui network
+QT -= widgets
+
+TARGET = loadgen
+TEMPLATE = app
+CONFIG += console release
+CONFIG -= app_bundle
+QMAKE_CXXFLAGS += -std=c++14
+INCLUDEPATH += $$PWD/../../src
+
+SOURCES +=  main.cpp                        \
+            ../../src/CommandClient.cpp     \
+            ../../src/CommandProtocol.cpp   \
+            ../../src/CommandRing.cpp       \
+            ../../src/CommandStats.cpp
+
+HEADERS +=  ../../src/CommandClient.h       \
+            ../../src/CommandProtocol.h     \
+            ../../src/CommandRing.h         \
+            ../../src/CommandStats.h
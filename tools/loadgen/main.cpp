@@ -0,0 +1,392 @@
+/*
+Copyright (c), Helios
+All rights reserved.
+
+Distributed under a permissive license. See COPYING.txt for details.
+*/
+
+#include "CommandClient.h"
+#include "CommandStats.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFileInfo>
+#include <QImage>
+#include <QProcess>
+#include <QTemporaryDir>
+#include <QThread>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace{
+
+enum class CommandKind{
+	Load,
+	Move,
+	Rotate,
+	AnimMove,
+	Count,
+};
+
+const char * const kind_names[] = {
+	"load",
+	"move",
+	"rotate",
+	"animmove",
+};
+
+static_assert(sizeof(kind_names) / sizeof(*kind_names) == (size_t)CommandKind::Count, "Command names are out of date.");
+
+typedef std::array<int, (size_t)CommandKind::Count> mix_t;
+
+struct Options{
+	QString server_name;
+	QString image_path;
+	int clients = 4;
+	int commands = 10000;
+	int windows = 8;
+	int pipeline = 32;
+	bool binary = false;
+	bool timestamps = false;
+	unsigned seed = 1;
+	int timeout = 5000;
+	//Relative weights of each kind of command.
+	mix_t mix = {{ 1, 70, 20, 9 }};
+};
+
+struct ClientResult{
+	std::array<LatencyHistogram, (size_t)CommandKind::Count> latencies;
+	quint64 sent = 0;
+	quint64 succeeded = 0;
+	quint64 failed = 0;
+	QString error;
+};
+
+//"move=70,rotate=20". Kinds that aren't mentioned get a weight of 0.
+bool parse_mix(mix_t &dst, const QString &s){
+	mix_t ret;
+	ret.fill(0);
+	for (auto &item : s.split(',', QString::SkipEmptyParts)){
+		auto parts = item.split('=');
+		if (parts.size() != 2)
+			return false;
+		bool ok;
+		auto weight = parts[1].toInt(&ok);
+		if (!ok || weight < 0)
+			return false;
+		auto it = std::find_if(std::begin(kind_names), std::end(kind_names), [&](const char *name){ return parts[0] == name; });
+		if (it == std::end(kind_names))
+			return false;
+		ret[it - std::begin(kind_names)] = weight;
+	}
+	if (std::all_of(ret.begin(), ret.end(), [](int x){ return !x; }))
+		return false;
+	dst = ret;
+	return true;
+}
+
+QString get_window_name(int client, int window){
+	return QString("loadgen_%1_%2").arg(client).arg(window);
+}
+
+class LoadClient{
+	const Options &options;
+	int index;
+	ClientResult &result;
+	CommandClient client;
+	std::mt19937 rng;
+	struct InFlight{
+		CommandKind kind;
+		qint64 sent;
+	};
+	std::deque<InFlight> in_flight;
+
+	bool fail(){
+		result.error = this->client.get_error();
+		return false;
+	}
+	bool setup();
+	void send(CommandKind, int window);
+	bool receive();
+public:
+	LoadClient(const Options &options, int index, ClientResult &result):
+		options(options),
+		index(index),
+		result(result),
+		rng(options.seed + index){}
+	bool run();
+};
+
+//Every client gets windows of its own, so that clients don't step on each
+//other.
+bool LoadClient::setup(){
+	if (!this->client.open(this->options.server_name, this->options.timeout))
+		return this->fail();
+	for (int i = 0; i < this->options.windows; i++){
+		auto name = get_window_name(this->index, i);
+		CommandResult result;
+		if (!this->client.execute(result, QStringList() << "load" << this->options.image_path << name, this->options.timeout))
+			return this->fail();
+		if (!result.success){
+			this->result.error = "setup failed: " + result.message;
+			return false;
+		}
+		if (this->options.binary){
+			this->client.bind(i, name);
+			CommandReply reply;
+			if (!this->client.receive(reply, this->options.timeout))
+				return this->fail();
+		}
+	}
+	this->client.set_timestamps(this->options.timestamps);
+	return true;
+}
+
+void LoadClient::send(CommandKind kind, int window){
+	std::uniform_int_distribution<int> coordinate(0, 500);
+	std::uniform_int_distribution<int> angle(0, 359);
+	if (this->options.binary && kind != CommandKind::Load){
+		switch (kind){
+			case CommandKind::Move:
+				{
+					BinaryCommandWriter command(Opcode::Move, window);
+					command.add_int(coordinate(this->rng)).add_int(coordinate(this->rng));
+					this->client.send(command);
+				}
+				break;
+			case CommandKind::Rotate:
+				{
+					BinaryCommandWriter command(Opcode::Rotate, window);
+					command.add_double(angle(this->rng));
+					this->client.send(command);
+				}
+				break;
+			case CommandKind::AnimMove:
+				{
+					BinaryCommandWriter command(Opcode::AnimMove, window);
+					command.add_int(coordinate(this->rng)).add_int(coordinate(this->rng)).add_double(200);
+					this->client.send(command);
+				}
+				break;
+			default:
+				break;
+		}
+	}else{
+		QStringList command;
+		command << kind_names[(size_t)kind];
+		auto name = get_window_name(this->index, window);
+		switch (kind){
+			case CommandKind::Load:
+				command << this->options.image_path << name;
+				break;
+			case CommandKind::Move:
+				command << name << QString::number(coordinate(this->rng)) << QString::number(coordinate(this->rng));
+				break;
+			case CommandKind::Rotate:
+				command << name << QString::number(angle(this->rng));
+				break;
+			case CommandKind::AnimMove:
+				command << name << QString::number(coordinate(this->rng)) << QString::number(coordinate(this->rng)) << "200";
+				break;
+			default:
+				break;
+		}
+		this->client.send(command);
+	}
+	InFlight sent;
+	sent.kind = kind;
+	sent.sent = get_timestamp();
+	this->in_flight.push_back(sent);
+	this->result.sent++;
+}
+
+//Replies arrive in order, so each one belongs to the oldest command in
+//flight.
+bool LoadClient::receive(){
+	CommandReply reply;
+	if (!this->client.receive(reply, this->options.timeout))
+		return this->fail();
+	auto &front = this->in_flight.front();
+	this->result.latencies[(size_t)front.kind].add(get_timestamp() - front.sent);
+	if (reply.result.success)
+		this->result.succeeded++;
+	else
+		this->result.failed++;
+	this->in_flight.pop_front();
+	return true;
+}
+
+bool LoadClient::run(){
+	if (!this->setup())
+		return false;
+	std::discrete_distribution<int> kinds(this->options.mix.begin(), this->options.mix.end());
+	std::uniform_int_distribution<int> windows(0, this->options.windows - 1);
+	for (int i = 0; i < this->options.commands; i++){
+		this->send((CommandKind)kinds(this->rng), windows(this->rng));
+		if ((int)this->in_flight.size() >= this->options.pipeline && !this->receive())
+			return false;
+	}
+	if (!this->client.flush(this->options.timeout))
+		return this->fail();
+	while (!this->in_flight.empty())
+		if (!this->receive())
+			return false;
+	this->client.close();
+	return true;
+}
+
+bool wait_for_server(const QString &name, int timeout){
+	typedef std::chrono::steady_clock T;
+	auto deadline = T::now() + std::chrono::milliseconds(timeout);
+	while (T::now() < deadline){
+		CommandClient client;
+		if (client.open(name, 250))
+			return true;
+		QThread::msleep(50);
+	}
+	return false;
+}
+
+QString server_command(const QString &name, const QStringList &command){
+	CommandClient client;
+	CommandResult result;
+	if (!client.open(name) || !client.execute(result, command))
+		return QString();
+	return result.message;
+}
+
+void print_latency(const char *name, const LatencyHistogram &histogram){
+	if (!histogram.get_count())
+		return;
+	std::cout
+		<< std::left << std::setw(12) << name << std::right
+		<< std::setw(10) << histogram.get_count()
+		<< std::setw(10) << histogram.get_percentile(0.5)
+		<< std::setw(10) << histogram.get_percentile(0.9)
+		<< std::setw(10) << histogram.get_percentile(0.99)
+		<< std::setw(10) << histogram.get_max() << "\n";
+}
+
+}
+
+int main(int argc, char **argv){
+	QCoreApplication app(argc, argv);
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Sends commands to a Borderless server from several clients at once and reports throughput and latency.");
+	parser.addHelpOption();
+#ifdef Q_OS_WIN
+	auto default_server = QDir(app.applicationDirPath()).filePath("Borderless.exe");
+#else
+	auto default_server = QDir(app.applicationDirPath()).filePath("Borderless");
+#endif
+	QCommandLineOption server_option("server", "Borderless executable to start headless.", "path", default_server);
+	QCommandLineOption connect_option("connect", "Use the already running server with this name instead of starting one.", "name");
+	QCommandLineOption clients_option("clients", "Number of concurrent clients.", "n", "4");
+	QCommandLineOption commands_option("commands", "Commands sent by each client.", "n", "10000");
+	QCommandLineOption windows_option("windows", "Windows loaded by each client.", "n", "8");
+	QCommandLineOption pipeline_option("pipeline", "Commands each client keeps in flight.", "n", "32");
+	QCommandLineOption mix_option("mix", "Relative weights of load, move, rotate and animmove.", "mix", "load=1,move=70,rotate=20,animmove=9");
+	QCommandLineOption image_option("image", "Image used by load commands. A small one is generated by default.", "path");
+	QCommandLineOption seed_option("seed", "Random seed.", "n", "1");
+	QCommandLineOption binary_option("binary", "Send move, rotate and animmove as binary commands.");
+	QCommandLineOption timestamps_option("timestamps", "Stamp commands with their send time and print the server's latency statistics.");
+	parser.addOptions({ server_option, connect_option, clients_option, commands_option, windows_option, pipeline_option, mix_option, image_option, seed_option, binary_option, timestamps_option });
+	parser.process(app);
+
+	Options options;
+	options.clients = std::max(parser.value(clients_option).toInt(), 1);
+	options.commands = std::max(parser.value(commands_option).toInt(), 0);
+	options.windows = std::max(parser.value(windows_option).toInt(), 1);
+	options.pipeline = std::max(parser.value(pipeline_option).toInt(), 1);
+	options.seed = parser.value(seed_option).toUInt();
+	options.binary = parser.isSet(binary_option);
+	options.timestamps = parser.isSet(timestamps_option);
+	if (!parse_mix(options.mix, parser.value(mix_option))){
+		std::cerr << "Invalid command mix.\n";
+		return 1;
+	}
+
+	QTemporaryDir temp;
+	if (parser.isSet(image_option))
+		options.image_path = QFileInfo(parser.value(image_option)).absoluteFilePath();
+	else{
+		options.image_path = QDir(temp.path()).filePath("loadgen.png");
+		QImage image(64, 64, QImage::Format_ARGB32);
+		image.fill(qRgba(255, 128, 0, 192));
+		if (!temp.isValid() || !image.save(options.image_path)){
+			std::cerr << "Can't create the test image.\n";
+			return 1;
+		}
+	}
+
+	QProcess server;
+	if (parser.isSet(connect_option))
+		options.server_name = parser.value(connect_option);
+	else{
+		options.server_name = QString("BorderlessLoadgen_%1").arg(app.applicationPid());
+		auto environment = QProcessEnvironment::systemEnvironment();
+		environment.insert("QT_QPA_PLATFORM", "offscreen");
+		server.setProcessEnvironment(environment);
+		server.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+		server.start(parser.value(server_option), QStringList() << "--test-server" << options.server_name);
+		if (!server.waitForStarted() || !wait_for_server(options.server_name, 10000)){
+			std::cerr << "Can't start the server: " << server.errorString().toStdString() << "\n";
+			server.kill();
+			return 1;
+		}
+	}
+
+	std::vector<ClientResult> results(options.clients);
+	std::vector<std::thread> threads;
+	typedef std::chrono::steady_clock T;
+	auto t0 = T::now();
+	for (int i = 0; i < options.clients; i++)
+		threads.emplace_back([&options, &results, i](){ LoadClient(options, i, results[i]).run(); });
+	for (auto &thread : threads)
+		thread.join();
+	auto seconds = std::chrono::duration<double>(T::now() - t0).count();
+
+	ClientResult total;
+	for (auto &result : results){
+		total.sent += result.sent;
+		total.succeeded += result.succeeded;
+		total.failed += result.failed;
+		for (size_t i = 0; i < total.latencies.size(); i++)
+			total.latencies[i].merge(result.latencies[i]);
+		if (!result.error.isEmpty())
+			std::cerr << "client error: " << result.error.toStdString() << "\n";
+	}
+	quint64 expected = (quint64)options.clients * options.commands;
+	auto completed = total.succeeded + total.failed;
+	std::cout
+		<< options.clients << " clients, " << expected << " commands" << (options.binary ? " (binary)" : "") << "\n"
+		<< "throughput   " << std::fixed << std::setprecision(0) << completed / seconds << " commands/s over " << std::setprecision(3) << seconds << " s\n"
+		<< "succeeded    " << total.succeeded << "\n"
+		<< "failed       " << total.failed << "\n"
+		<< "dropped      " << expected - completed << "\n\n"
+		<< std::left << std::setw(12) << "latency (us)" << std::right
+		<< std::setw(10) << "n" << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "max" << "\n";
+	LatencyHistogram all;
+	for (size_t i = 0; i < total.latencies.size(); i++){
+		print_latency(kind_names[i], total.latencies[i]);
+		all.merge(total.latencies[i]);
+	}
+	print_latency("all", all);
+
+	if (options.timestamps)
+		std::cout << "\nserver:\n" << server_command(options.server_name, QStringList("stats")).toStdString();
+
+	if (!parser.isSet(connect_option)){
+		server_command(options.server_name, QStringList("quit"));
+		if (!server.waitForFinished(5000))
+			server.kill();
+	}
+	return completed == expected && !total.failed ? 0 : 2;
+}